@@ -0,0 +1,129 @@
+/*
+ * pins.cpp
+ *
+ * Host check that pinned globals reach zd.mem intact when they share cache
+ * lines with other dynamic memory. The sample stories' globals don't start
+ * on a line boundary (minizork 0x2b4, sampler1 0x1efe, sampler2 0x21f3).
+ *
+ *   g++ -I../zorkduino -o pins pins.cpp ../zorkduino/zdIO.cpp && ./pins
+ *   g++ -DBIG_RAM=1 -I../zorkduino -o pins pins.cpp ../zorkduino/zdIO.cpp && ./pins
+ */
+
+#include "ztypes.h"
+
+// zd.mem in RAM, just the stack and game regions
+static uint8_t disk[GAME_REGION_OFFSET + DYNAMIC_MAX];
+
+uint8_t sector_data[512];
+uint8_t _fdata[TEXT_ROWS*TEXT_COLS];
+
+uint8_t sector_read(uint16_t s, uint8_t* data)
+{
+    memcpy(data,disk + ((uint32_t)s << 9),512);
+    return 0;
+}
+
+uint8_t sector_write(uint16_t s, uint8_t* data)
+{
+    memcpy(disk + ((uint32_t)s << 9),data,512);
+    return 0;
+}
+
+uint8_t sector_read_part(uint16_t s, uint8_t* data, uint16_t offset, uint8_t len)
+{
+    memcpy(data,disk + ((uint32_t)s << 9) + offset,len);
+    return 0;
+}
+
+uint8_t sector_read_async(uint16_t s, uint8_t* data) { return sector_read(s,data); }
+uint8_t sector_async_wait() { return 0; }
+
+// Interpreter state zdIO.cpp refers to
+zbyte_t h_type = 3;
+zbyte_t h_config;
+zword_t h_globals_offset;
+zword_t h_restart_size = 0x4000;
+zword_t sp, fp, op_sp;
+unsigned long pc, op_pc;
+uint8_t session_state;
+
+// Never reached from here
+void print_time(int, int) {}
+void write_char(int) {}
+void print_number(zword_t) {}
+void write_string(char*) {}
+void new_line() {}
+void pre_input_line() {}
+int input_character(int) { return 0; }
+zword_t load_variable(int) { return 0; }
+void store_operand(zword_t) {}
+void conditional_jump(int) {}
+uint8_t save_store(uint8_t, uint16_t) { return 1; }
+uint8_t save_load(uint8_t, uint16_t) { return 1; }
+uint16_t save_sector(uint8_t, uint16_t) { return 0; }
+uint8_t quetzal_export() { return 1; }
+uint8_t quetzal_import() { return 1; }
+uint8_t pagefile_read(pageheader_t*) { return 1; }
+uint8_t pagefile_write(pageheader_t*) { return 1; }
+uint8_t journal_apply(bool) { return 0; }
+uint8_t journal_commit(unsigned long, zword_t, zword_t) { return 1; }
+
+void cache_flush_all();
+
+static int failed;
+
+// ztypes.h defines const away, so no string literals
+static void expect(int line, unsigned got, unsigned want)
+{
+    if (got != want) {
+        printf("FAIL line %d: got %u, want %u\n",line,got,want);
+        failed++;
+    }
+}
+
+#define EXPECT(_got,_want) expect(__LINE__,_got,_want)
+
+static unsigned on_card(zword_t a)
+{
+    const uint8_t* d = disk + GAME_REGION_OFFSET + a;
+    return (d[0] << 8) | d[1];
+}
+
+// Every global around where the pins end, 4 on 2k parts and 240 on big
+// ones, shares a line with its neighbours
+static void check(zword_t globals)
+{
+    memset(disk,0,sizeof(disk));
+    h_globals_offset = globals;
+    pin_load();
+
+    for (int pass = 1; pass <= 2; pass++)
+    {
+        zbyte_t n;
+        for (n = 0; n <= 240; n++)
+            store_global(n,n*pass + pass);
+        cache_flush_all();
+        for (n = 0; n <= 240; n++)
+            EXPECT(on_card(globals + (n << 1)),n*pass + pass);
+    }
+
+    // A word read that starts just before the pins must see their RAM copy
+    set_byte(globals - 1,9);
+    store_global(0,0x2233);
+    unsigned long a = globals - 1;
+    EXPECT(read_data_word(&a),0x0922);
+    cache_flush_all();
+    EXPECT(on_card(globals),0x2233);
+}
+
+int main()
+{
+    check(0x2b4);
+    check(0x1efe);
+    check(0x21f3);
+    check(0xffa);
+    check(0x200);
+    if (!failed)
+        printf("ok\n");
+    return failed != 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * zdsave.cpp
+ *
+ * Moves Quetzal saves between zd.mem and the host. Saving to slot E on the
+ * device leaves an IFZS file in zd.mem's export area; restoring from slot E
+ * reads whatever was put there. Any Quetzal interpreter can load and write
+ * the files, as long as it is the same story.
+ *
+ *   g++ -I../zorkduino -o zdsave zdsave.cpp
+ *
+ *   zdsave export zd.mem game.qzl   copy the export area out
+ *   zdsave import zd.mem game.qzl   put a save in the export area
+ *   zdsave info game.qzl            show what a save holds
+ */
+
+#include "ztypes.h"
+
+#define EXPORT_OFFSET   ((long)EXPORT_SECTOR << 9)
+#define EXPORT_SIZE     ((long)EXPORT_SECTORS << 9)
+
+static uint32_t be32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Read a whole file, or at most max bytes from offset
+static long load(const char* path, long offset, long max, uint8_t* d)
+{
+    FILE* f = fopen(path,"rb");
+    if (!f || fseek(f,offset,SEEK_SET)) {
+        perror(path);
+        return -1;
+    }
+    long n = fread(d,1,max,f);
+    fclose(f);
+    return n;
+}
+
+// Length of the IFZS file at d, 0 if it isn't one
+static long form_length(const uint8_t* d, long n)
+{
+    if (n < 12 || memcmp(d,"FORM",4) || memcmp(d+8,"IFZS",4))
+        return 0;
+    long len = be32(d+4) + 8;
+    return len <= n ? len : 0;
+}
+
+static int info(const uint8_t* d, long n)
+{
+    for (long p = 12; p + 8 <= n; )
+    {
+        long len = be32(d+p+4);
+        printf("%.4s %6ld",(const char*)d+p,len);
+        if (!memcmp(d+p,"IFhd",4) && len >= 13) {
+            const uint8_t* h = d+p+8;
+            printf("  release %d serial %.6s checksum %04X pc %06lX",(h[0] << 8) | h[1],
+                (const char*)h+2,(h[8] << 8) | h[9],(long)be32(h+9) & 0xFFFFFF);
+        }
+        printf("\n");
+        p += 8 + len + (len & 1);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static uint8_t d[EXPORT_SIZE];
+    if (argc == 3 && !strcmp(argv[1],"info"))
+    {
+        long n = form_length(d,load(argv[2],0,sizeof(d),d));
+        if (!n) {
+            fprintf(stderr,"%s: not a Quetzal save\n",argv[2]);
+            return 1;
+        }
+        return info(d,n);
+    }
+    if (argc != 4 || (strcmp(argv[1],"export") && strcmp(argv[1],"import"))) {
+        fprintf(stderr,"usage: zdsave export|import zd.mem save.qzl\n       zdsave info save.qzl\n");
+        return 1;
+    }
+
+    bool out = !strcmp(argv[1],"export");
+    const char* src = out ? argv[2] : argv[3];
+    long n = load(src,out ? EXPORT_OFFSET : 0,sizeof(d),d);
+    if ((n = form_length(d,n)) == 0) {
+        fprintf(stderr,"%s: no Quetzal save%s\n",src,out ? " in the export area" : " or too big");
+        return 1;
+    }
+
+    FILE* f = out ? fopen(argv[3],"wb") : fopen(argv[2],"r+b");
+    if (!f || (!out && fseek(f,EXPORT_OFFSET,SEEK_SET)) || fwrite(d,1,n,f) != (size_t)n) {
+        perror(out ? argv[3] : argv[2]);
+        return 1;
+    }
+    fclose(f);
+    return info(d,n);
+}
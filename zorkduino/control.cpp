@@ -76,20 +76,24 @@ int type;
         return (0);
     }
 
-    /* Save current PC, FP and argument count on stack */
+    /* Start fetching the routine while the frame is pushed */
+
+    prefetch_code ((unsigned long) argv[0] * story_scaler);
+
+    /* Save current PC, FP, argument and local counts on stack */
     PUSH(pc / PAGE_SIZE);
     PUSH(pc % PAGE_SIZE);
     PUSH(fp);
-    PUSH((argc - 1) | type);
     
-    /* Create FP for new subroutine and load new PC */
+    /* Load new PC, read local count and create FP for new subroutine */
 
-    fp = sp - 1;
     pc = (unsigned long) argv[0] * story_scaler;
+    args = (unsigned int) read_code_byte ();
+    PUSH((argc - 1) | type | (args << VARS_SHIFT));
+    fp = sp - 1;
 
-    /* Read argument count and initialise local variables */
+    /* Initialise local variables */
 
-    args = (unsigned int) read_code_byte ();
     while (--args >= 0) {
         arg = (h_type > V4) ? 0 : read_code_word ();
         PUSH((--argc > 0) ? argv[i++] : arg);
@@ -213,11 +217,9 @@ void restart ()
 
    // scripting_flag = get_word (H_FLAGS) & SCRIPTING_FLAG;
 
-    /* Load restart size and reload writeable data area */
+    /* Reload the writeable data area, just the sectors written since loading */
 
-    //restart_size = (h_restart_size / PAGE_SIZE) + 1;
-    //for (i = 0; i < restart_size; i++)
-    //  read_page (i, &datap[i * PAGE_SIZE]);
+    restart_reload ();
 
     /* Restart the screen */
 
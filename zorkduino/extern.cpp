@@ -19,7 +19,7 @@ zword_t h_start_pc = 0;
 zword_t h_words_offset = 0;
 zword_t h_objects_offset = 0;
 zword_t h_globals_offset = 0;
-//zword_t h_restart_size = 0;
+zword_t h_restart_size = 0;
 //zword_t h_flags = 0;
 zword_t h_synonyms_offset = 0;
 //zword_t h_file_size = 0;
@@ -40,6 +40,8 @@ uint8_t property_size_mask = 0;
 zword_t sp = STACK_SIZE;
 zword_t fp = STACK_SIZE - 1;
 unsigned long pc = 0;
+zword_t op_sp = STACK_SIZE;         /* pc and sp at the start of the current instruction */
+unsigned long op_pc = 0;
 uint8_t interpreter_state = RUN;
 int interpreter_status = 0;
 
@@ -19,6 +19,7 @@ static unsigned int entry_size = 0; // 8 TODO
 static void tokenise_line (zword_t, zword_t, zword_t, zword_t);
 static zword_t next_token (zword_t s, zword_t *token, int *length, const char *punctuation);
 static zword_t find_word (int, zword_t, long);
+static long compare_entry (const short *, long);
 
 /*
  * read_character
@@ -120,6 +121,10 @@ zword_t *argv;
     if (argc < 2)
 	argv[1] = 0;
 
+    /* Bring zd.mem up to date so the session can be resumed at this read */
+
+    session_checkpoint ();
+
     /* Refresh status line */
 
     if (h_type < V4)
@@ -382,6 +387,37 @@ static zword_t next_token (zword_t s, zword_t *token, int *length, const char *p
 
 }/* next_token */
 
+/*
+ * compare_entry
+ *
+ * Compare an encoded word against a dictionary entry. Reads the entry
+ * straight out of the cache line rather than a word at a time.
+ *
+ */
+
+static long compare_entry (const short *word, long offset)
+{
+    zbyte_t n;
+    zbyte_t *d = read_data_span (offset, &n);
+    int i, words = (h_type < V4) ? 2 : 3;
+    long status = 0;
+
+    for (i = 0; i < words && status == 0; i++) {
+        zword_t w;
+        if (n >= 2) {
+            w = (d[0] << 8) | d[1];
+            d += 2;
+            n -= 2;
+        } else {
+            n = 0;
+            w = get_word (offset + i * 2);
+        }
+        status = word[i] - (short) w;
+    }
+    return (status);
+
+}/* compare_entry */
+
 /*
  * find_word
  *
@@ -426,10 +462,7 @@ static zword_t find_word (int len, zword_t cp, long chop)
 
 	    /* If word matches then return dictionary offset */
 
-	    if ((status = word[0] - (short) get_word (offset + 0)) == 0 &&
-		(status = word[1] - (short) get_word (offset + 2)) == 0 &&
-		(h_type < V4 ||
-		(status = word[2] - (short) get_word (offset + 4)) == 0))
+	    if ((status = compare_entry (word, offset)) == 0)
 		return ((zword_t) offset);
 
 	    /* Set next position depending on direction of overshoot */
@@ -460,10 +493,7 @@ static zword_t find_word (int len, zword_t cp, long chop)
 
 	    /* If word matches then return dictionary offset */
 
-	    if ((status = word[0] - (short) get_word (offset + 0)) == 0 &&
-		(status = word[1] - (short) get_word (offset + 2)) == 0 &&
-		(h_type < V4 ||
-		(status = word[2] - (short) get_word (offset + 4)) == 0))
+	    if ((status = compare_entry (word, offset)) == 0)
 		return ((zword_t) offset);
 	}
     }
@@ -34,6 +34,8 @@ int interpret ()
 
         /* Load opcode and set operand count */
 
+        op_pc = pc;
+        op_sp = sp;
         opcode = read_code_byte ();
         if (h_type > V4 && opcode == 0xbe) {
             opcode = read_code_byte ();
@@ -84,7 +84,7 @@ void configure (zbyte_t min_version, zbyte_t max_version)
     h_words_offset = get_word (H_WORDS_OFFSET);
     h_objects_offset = get_word (H_OBJECTS_OFFSET);
     h_globals_offset = get_word (H_GLOBALS_OFFSET);
-    //h_restart_size = get_word (H_RESTART_SIZE);
+    h_restart_size = get_word (H_RESTART_SIZE);   /* size of dynamic memory */
     //h_flags = get_word (H_FLAGS);
     h_synonyms_offset = get_word (H_SYNONYMS_OFFSET);
     //h_file_size = get_word (H_FILE_SIZE);
@@ -92,4 +92,8 @@ void configure (zbyte_t min_version, zbyte_t max_version)
     //    h_file_size = get_story_size ();
     //h_checksum = get_word (H_CHECKSUM);
     h_alternate_alphabet_offset = get_word (H_ALTERNATE_ALPHABET_OFFSET);
+
+    /* Pin the globals and header in RAM now their location is known */
+
+    pin_load ();
 }/* configure */
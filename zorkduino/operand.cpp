@@ -105,7 +105,7 @@ int number;
 
             /* number > 15, it's a global variable */
 
-            variable = get_word (h_globals_offset + ((number - 16) * 2));
+            variable = load_global (number - 16);
     } else
 
         /* number = 0, get from top of stack */
@@ -143,7 +143,7 @@ zword_t variable;
 
             /* number > 15, it's a global variable */
 
-            set_word (h_globals_offset + ((number - 16) * 2), variable);
+            store_global (number - 16, variable);
     } else
 
         /* number = 0, get from top of stack */
@@ -384,6 +384,7 @@ int print_status (int argc, char *argv[])
 
 void configure(zbyte_t min_version, zbyte_t max_version);
 void cache_init();  // zdIO.cpp
+void session_restore();  // zorkduino.ino
 
 void zdInit()
 {
@@ -391,6 +392,7 @@ void zdInit()
     initialize_screen();
     configure (V1, V8);
     restart();
+    session_restore();
 }
 
 void zdLoop()
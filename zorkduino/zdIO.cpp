@@ -24,85 +24,443 @@
 #define LINE_COUNT (128/LINE_SIZE)
 #define EMPTY 0xFFFF
 
-uint8_t cache_next = 0;
+// Lines are grouped into sets of WAY_COUNT, a line can only live in one set
+#define WAY_BITS 2
+#define WAY_COUNT (1 << WAY_BITS)
+#define SET_COUNT (LINE_COUNT >> WAY_BITS)
+#define SET_MASK ((SET_COUNT)-1)
+
+// Fold in higher bits so strided walks (object table etc) spread across sets
+#define SET_INDEX(_p) (((_p) ^ ((_p) >> 5)) & SET_MASK)
+
+// Replacement policy, picked at compile time. State is one byte per set.
+#define CACHE_ROUND_ROBIN   0   // rotating victim, skips dirty lines if it can
+#define CACHE_CLOCK         1   // second chance: ref bit per way + hand
+#define CACHE_LRU           2   // true LRU: WAY_BITS age per way
+#define CACHE_CLEAN_LRU     3   // oldest clean line, oldest dirty if none
+
+#ifndef CACHE_POLICY
+#define CACHE_POLICY CACHE_ROUND_ROBIN
+#endif
+
+#if (CACHE_POLICY == CACHE_CLOCK) && (WAY_COUNT + WAY_BITS > 8)
+#error "CLOCK state does not fit in a byte per set"
+#endif
+#if (CACHE_POLICY >= CACHE_LRU) && (WAY_COUNT*WAY_BITS > 8)
+#error "LRU ages do not fit in a byte per set"
+#endif
+
+uint8_t cache_repl[SET_COUNT];
 uint8_t cache_last = 0;
 uint16_t cache_pos[LINE_COUNT];
 uint8_t cache_dirty[(LINE_COUNT+7) >> 3] = {0};
 uint8_t cache_data[LINE_COUNT*LINE_SIZE];
 
+// Instruction stream: what is left of the line or sector pc is fetching from
+#define CODE_BLOCK 0x80     // code_slot is a BlockCache index, not a line
+uint8_t* code_ptr;
+uint16_t code_left = 0;
+uint8_t code_slot = 0xFF;
+unsigned long code_pc;
+
+// Top of the Z-stack, in words
+#ifndef STACK_WINDOW
+#if BIG_RAM
+#define STACK_WINDOW 64
+#else
+#define STACK_WINDOW 8
+#endif
+#endif
+#define STACK_NONE 0x8000
+
+zword_t stack_window[STACK_WINDOW];
+zword_t stack_base = STACK_NONE;    // stack index of stack_window[0]
+
+// Hot globals and the header live in RAM, pinned outside the line cache
+#ifndef GLOBALS_PINNED
+#if BIG_RAM
+#define GLOBALS_PINNED 240
+#define HEADER_PINNED 1
+#else
+#define GLOBALS_PINNED 4    // location, score and moves: status line redraws
+#define HEADER_PINNED 0
+#endif
+#endif
+
+uint8_t pin_globals[GLOBALS_PINNED*2];
+#if HEADER_PINNED
+uint8_t pin_header[64];
+#endif
+zword_t pin_globals_offset = EMPTY;
+uint8_t pin_dirty = 0;
+
+//  Regions, from the header: dynamic memory is [0,h_restart_size), static
+//  and high memory sit above it and are read only. Only dynamic lines can
+//  be dirty. With more than one block, read only data and code are read
+//  straight from the block cache and never take up a line.
+
+// Sectors held under the line cache. 2k parts only have room for sector_data
+#ifndef BLOCK_COUNT
+#if BIG_RAM
+#define BLOCK_COUNT 4
+#else
+#define BLOCK_COUNT 1
+#endif
+#endif
+
+#if BLOCK_COUNT > 8
+#error "BLOCK_COUNT dirty/ref bits only fit in a uint8_t"
+#endif
+
+#if (SAVE_POOL || QUETZAL) && BLOCK_COUNT < 3
+#error "SAVE_POOL and QUETZAL need two spare blocks, see zdSave.cpp"
+#endif
+
 extern uint8_t sector_data[512];
-void sector_read(uint16_t s);
-void sector_write(uint16_t s);
+uint8_t sector_read(uint16_t s, uint8_t* data = sector_data);
+uint8_t sector_write(uint16_t s, uint8_t* data = sector_data);
+uint8_t sector_read_part(uint16_t s, uint8_t* data, uint16_t offset, uint8_t len);
+uint8_t sector_read_async(uint16_t s, uint8_t* data);
+uint8_t sector_async_wait();
+
+#if BLOCK_COUNT > 1
+uint8_t block_data[BLOCK_COUNT-1][512];
+#define BLOCK_DATA(_i) ((_i) ? block_data[(_i)-1] : sector_data)
+#else
+#define BLOCK_DATA(_i) sector_data
+#endif
+
+#define STREAM_LIMIT 4
 
+// Runtime switches, zd.cfg can turn these off
+uint8_t config_prefetch = 1;        // background reads of call targets
+uint8_t config_checkpoint = 1;      // resume points at each line read
+uint8_t config_undo = 1;            // save_undo/restore_undo
+
+//  Write-back sector cache, CLOCK replacement
 class BlockCache
 {
 public:
-    uint16_t _mark;
-    uint8_t _dirty;
-    BlockCache() : _mark(EMPTY),_dirty(0) {}
-    
-    uint8_t* find(uint32_t p)
+    uint16_t _mark[BLOCK_COUNT];
+    uint8_t _dirty;     // bit per block
+    uint8_t _ref;       // CLOCK reference bits
+    uint8_t _hand;
+    uint8_t _last;
+    uint8_t _streamed;  // fills streamed past dirty blocks since the last load
+    uint8_t _pending;   // block being read in the background
+    BlockCache() : _dirty(0),_ref(0),_hand(0),_last(0),_streamed(0),_pending(0xFF)
+    {
+        for (uint8_t i = 0; i < BLOCK_COUNT; i++)
+            _mark[i] = EMPTY;
+    }
+
+    // Wait for a background read to land
+    void sync()
+    {
+        if (sector_async_wait())
+            _mark[_pending] = EMPTY;
+        _pending = 0xFF;
+    }
+
+    uint8_t lookup(uint16_t s)
+    {
+        uint8_t i = _last;
+        if (_mark[i] != s)
+        {
+            for (i = 0; i < BLOCK_COUNT; i++)
+                if (_mark[i] == s)
+                    break;
+            if (i == BLOCK_COUNT)
+                return i;
+        }
+        if (i == _pending)
+        {
+            sync();
+            if (_mark[i] != s)
+                return BLOCK_COUNT;
+        }
+        return i;
+    }
+
+    // Start reading a sector we are about to need into a clean block
+    void prefetch(uint32_t p)
     {
         uint16_t s = p >> 9;
-        if (s != _mark)
+        if (_pending != 0xFF || lookup(s) != BLOCK_COUNT)
+            return;
+        uint8_t i = victim();
+        uint8_t b = 1 << i;
+        if (_dirty & b)
+        {
+            _ref |= b;      // writing it back would stall, skip
+            return;
+        }
+        evict(i);
+        if (sector_read_async(s,BLOCK_DATA(i)))
+            return;
+        _mark[i] = s;
+        _pending = i;
+        _ref |= b;
+    }
+
+    uint8_t* find(uint32_t p)
+    {
+        uint8_t i = lookup(p >> 9);
+        if (i == BLOCK_COUNT)
             return 0;
-        return sector_data + (p & 0x1FF);
+        return BLOCK_DATA(i) + (p & 0x1FF);
+    }
+
+    // Second chance: skip blocks touched since the hand last passed
+    uint8_t victim()
+    {
+        for (;;)
+        {
+            uint8_t i = _hand;
+            if (++_hand == BLOCK_COUNT)
+                _hand = 0;
+            uint8_t b = 1 << i;
+            if (!(_ref & b))
+                return i;
+            _ref &= ~b;
+        }
+    }
+
+    void evict(uint8_t i)
+    {
+        if (i == _pending)
+            sync();
+        if (code_slot == (CODE_BLOCK | i))
+            code_left = 0;
+        uint8_t b = 1 << i;
+        if (_dirty & b) {
+            sector_write(_mark[i],BLOCK_DATA(i));
+            _dirty &= ~b;
+        }
+        _mark[i] = EMPTY;
+    }
+
+    uint8_t load(uint16_t s, uint8_t i)
+    {
+        evict(i);
+        sector_read(s,BLOCK_DATA(i));
+        _mark[i] = s;
+        _streamed = 0;
+        return i;
     }
 
     uint8_t* seek(uint32_t p)
     {
         uint16_t s = p >> 9;
-        if (_mark != s) {
-            if (_dirty) {
-                sector_write(_mark);
-                _dirty = 0;
+        uint8_t i = lookup(s);
+        if (i == BLOCK_COUNT)
+            i = load(s,victim());
+        _last = i;
+        _ref |= 1 << i;
+        return BLOCK_DATA(i) + (p & 0x1FF);
+    }
+    
+    // Fill a line. If making room would mean writing back a dirty sector,
+    // stream just the bytes wanted from the card and leave the blocks be.
+    // Only a few times though: a read that keeps missing wants a block.
+    void fill(uint32_t p, uint8_t* dst, uint8_t len)
+    {
+        uint16_t s = p >> 9;
+        uint8_t i = lookup(s);
+        if (i == BLOCK_COUNT)
+        {
+            i = victim();
+            if ((_dirty & (1 << i)) && _streamed < STREAM_LIMIT)
+            {
+                _streamed++;
+                _ref |= 1 << i;     // give it another lap
+                sector_read_part(s,dst,p & 0x1FF,len);
+                return;
             }
-            sector_read(s);
-            _mark = s;
+            load(s,i);
         }
-        return sector_data + (p & 0x1FF);
+        _last = i;
+        _ref |= 1 << i;
+        memcpy(dst,BLOCK_DATA(i) + (p & 0x1FF),len);
     }
-    
+
     void write(uint32_t p, uint8_t* src, uint8_t len)
     {
         uint8_t* dst = seek(p);
+        uint8_t dirty = 0;
         while (len--)
         {
-            _dirty |= *src != *dst;
+            dirty |= *src != *dst;
             *dst++ = *src++;
         }
+        if (dirty)
+            _dirty |= 1 << _last;
     }
     
     void  flush()
     {
-        if (_dirty)
-            sector_write(_mark);
+        for (uint8_t i = 0; i < BLOCK_COUNT; i++)
+            evict(i);
+        _ref = 0;
+    }
+
+    // Write back dirty blocks but keep them
+    void clean()
+    {
+        for (uint8_t i = 0; i < BLOCK_COUNT; i++)
+            if (_dirty & (1 << i))
+                sector_write(_mark[i],BLOCK_DATA(i));
         _dirty = 0;
-        _mark = 0xFFFF;
     }
 };
 
 BlockCache blockCache;
 
+// A call is about to jump to a; start its sector on the way in the background
+#ifndef prefetch_code
+void prefetch_code(unsigned long a)
+{
+#if BLOCK_COUNT > 1
+    if (config_prefetch && a >= h_restart_size)
+        blockCache.prefetch(a + GAME_REGION_OFFSET);
+#else
+    (void)a;
+#endif
+}
+#endif
+
+// Raw block buffers for bulk copies, only once cache_flush_all has emptied them
+uint8_t* block_buffer(uint8_t i)
+{
+    return i < BLOCK_COUNT ? BLOCK_DATA(i) : 0;
+}
+
 //=======================================================================
 //=======================================================================
 //  Cache. Hate this code.
 
 // cost 300 bytes. eww
-#define GET_DIRTY(_n) cache_dirty[_n>>3] & (0x80 >> (_n & 7))
-#define SET_DIRTY(_n) cache_dirty[_n>>3] |= (0x80 >> (_n & 7))
-#define CLEAR_DIRTY(_n) cache_dirty[_n>>3] &= ~(0x80 >> (_n & 7))
+#define GET_DIRTY(_n) (cache_dirty[(_n)>>3] & (0x80 >> ((_n) & 7)))
+#define SET_DIRTY(_n) (cache_dirty[(_n)>>3] |= (0x80 >> ((_n) & 7)))
+#define CLEAR_DIRTY(_n) (cache_dirty[(_n)>>3] &= ~(0x80 >> ((_n) & 7)))
 
 #define _WRITE 1
 #define _STACK 2
 
+#define AGE(_r,_w) (((_r) >> ((_w)*WAY_BITS)) & (WAY_COUNT-1))
+
+void repl_init()
+{
+    for (uint8_t set = 0; set < SET_COUNT; set++)
+    {
+        uint8_t r = 0;
+#if CACHE_POLICY >= CACHE_LRU
+        for (uint8_t w = 0; w < WAY_COUNT; w++)
+            r |= w << (w*WAY_BITS);     // ages must start as a permutation
+#endif
+        cache_repl[set] = r;
+    }
+}
+
+// Way w of set was just used
+void repl_touch(uint8_t set, uint8_t w)
+{
+#if CACHE_POLICY == CACHE_ROUND_ROBIN
+    (void)set;              // the victim rotates regardless of use
+    (void)w;
+#elif CACHE_POLICY == CACHE_CLOCK
+    cache_repl[set] |= 1 << w;
+#elif CACHE_POLICY >= CACHE_LRU
+    uint8_t r = cache_repl[set];
+    uint8_t a = AGE(r,w);
+    uint8_t n = 0;
+    for (uint8_t k = 0; k < WAY_COUNT; k++)
+    {
+        uint8_t ak = AGE(r,k);
+        if (k == w)
+            ak = 0;
+        else if (ak < a)
+            ak++;
+        n |= ak << (k*WAY_BITS);
+    }
+    cache_repl[set] = n;
+#endif
+}
+
+// Way to evict from a full set
+uint8_t repl_victim(uint8_t set)
+{
+    uint8_t r = cache_repl[set];
+#if CACHE_POLICY == CACHE_ROUND_ROBIN
+    uint8_t base = set << WAY_BITS;
+    uint8_t n = (r + 1) & (WAY_COUNT-1);  // about as good as random..better than lru
+    for (uint8_t i = 0; i < WAY_COUNT; i++)
+    {
+        uint8_t w = (n + i) & (WAY_COUNT-1);
+        if (!(GET_DIRTY(base + w)))     // Favor evicting read cache
+        {
+            n = w;
+            break;
+        }
+    }
+    cache_repl[set] = n;
+    return n;
+#elif CACHE_POLICY == CACHE_CLOCK
+    uint8_t hand = r >> WAY_COUNT;
+    for (;;)
+    {
+        uint8_t b = 1 << hand;
+        if (!(r & b))
+            break;
+        r &= ~b;
+        hand = (hand + 1) & (WAY_COUNT-1);
+    }
+    cache_repl[set] = (r & ((1 << WAY_COUNT)-1)) | (((hand + 1) & (WAY_COUNT-1)) << WAY_COUNT);
+    return hand;
+#else
+    uint8_t oldest = 0;
+    uint8_t best = 0;
+#if CACHE_POLICY == CACHE_CLEAN_LRU
+    uint8_t base = set << WAY_BITS;
+    uint8_t clean = 0xFF;
+    uint8_t clean_age = 0;
+#endif
+    for (uint8_t i = 0; i < WAY_COUNT; i++)
+    {
+        uint8_t a = AGE(r,i);
+        if (a >= oldest)
+        {
+            oldest = a;
+            best = i;
+        }
+#if CACHE_POLICY == CACHE_CLEAN_LRU
+        if (!(GET_DIRTY(base + i)) && (clean == 0xFF || a > clean_age))
+        {
+            clean = i;
+            clean_age = a;
+        }
+#endif
+    }
+#if CACHE_POLICY == CACHE_CLEAN_LRU
+    if (clean != 0xFF)
+        return clean;
+#endif
+    return best;
+#endif
+}
+
 void cache_init()
 {
     //printf("%d lines of %d, %d bytes\n",LINE_COUNT,LINE_SIZE,(int)(sizeof(cache_data) + sizeof(cache_pos)+ sizeof(cache_dirty)));
     for (uint8_t i = 0; i < LINE_COUNT; i++)
         cache_pos[i] = EMPTY;
+    code_left = 0;
+    stack_base = STACK_NONE;
+    repl_init();
 }
 
+void pin_overlay(uint32_t a, uint8_t* d, uint8_t len);
+
 void cache_flush(uint16_t sector)
 {
     uint8_t* d = cache_data;
@@ -113,6 +471,8 @@ void cache_flush(uint16_t sector)
             uint32_t a = ((uint32_t)cache_pos[i]) << LINE_BITS;
             if ((a >> 9) == sector)
             {
+                if (a >= GAME_REGION_OFFSET)
+                    pin_overlay(a - GAME_REGION_OFFSET,d,LINE_SIZE);
                 blockCache.write(a,d,LINE_SIZE);
                 CLEAR_DIRTY(i);
             }
@@ -121,40 +481,164 @@ void cache_flush(uint16_t sector)
     }
 }
 
-void cache_flush_all()
+void stack_spill();
+void pin_flush();
+
+// Write everything dirty back to zd.mem, caches stay valid.
+// Pins go last so they land over any line that shares their sector.
+void cache_sync()
 {
+    stack_spill();
     for (uint8_t i = 0; i < LINE_COUNT; i++)
     {
         if ((cache_pos[i] != EMPTY) && (GET_DIRTY(i)))
             cache_flush(cache_pos[i] >> (9 - LINE_BITS));
     }
+    pin_flush();
+    blockCache.clean();
+}
+
+// Before zd.mem is read or written in place
+void cache_flush_all()
+{
+    cache_sync();
     blockCache.flush();
+#if JOURNAL
+    journal_apply(false);
+#endif
 }
 
-uint8_t cache_getslot()
+// Pick a victim within a set, empty lines first
+uint8_t cache_getslot(uint8_t set)
 {
+    uint8_t base = set << WAY_BITS;
     uint8_t i;
-    uint8_t write_count = 0;
-    for (i = 0; i < LINE_COUNT; i++)
-    {
-        uint16_t cp = cache_pos[i];
-        if (cp == EMPTY)
+    for (i = base; i < base + WAY_COUNT; i++)
+        if (cache_pos[i] == EMPTY)
             return i;
-        if (GET_DIRTY(i))
-            write_count++;
+    return base + repl_victim(set);
+}
+
+//=======================================================================
+//=======================================================================
+//  Pinned globals and header. Loaded by configure(), written back by
+//  cache_flush_all(). Any access that lands in them, not just load_variable
+//  and store_variable, is served from RAM so they stay coherent.
+
+// Write a RAM copy back through the block cache a sector at a time
+void pin_write(uint32_t a, uint8_t* src, uint16_t len)
+{
+    a += GAME_REGION_OFFSET;
+    while (len)
+    {
+        uint16_t n = 512 - (a & 0x1FF);
+        if (n > len)
+            n = len;
+        if (n > 255)
+            n = 255;
+        blockCache.write(a,src,n);
+        a += n;
+        src += n;
+        len -= n;
     }
-    write_count = write_count >= LINE_COUNT*2/3;  // Favor evicting read cache
-    
-    while (cache_pos[i] != EMPTY)
+}
+
+void pin_read(uint32_t a, uint8_t* dst, uint16_t len)
+{
+    a += GAME_REGION_OFFSET;
+    while (len--)
+        *dst++ = *blockCache.seek(a++);
+}
+
+void pin_flush()
+{
+    if (!pin_dirty || pin_globals_offset == EMPTY)
+        return;
+    pin_write(pin_globals_offset,pin_globals,sizeof(pin_globals));
+#if HEADER_PINNED
+    pin_write(0,pin_header,sizeof(pin_header));
+#endif
+    pin_dirty = 0;
+}
+
+// Drops the line cache and stack window without writing them back, so
+// only call it when they are clean or stale (configure, restore)
+void pin_load()
+{
+    cache_init();
+    pin_globals_offset = h_globals_offset;
+    pin_read(pin_globals_offset,pin_globals,sizeof(pin_globals));
+#if HEADER_PINNED
+    pin_read(0,pin_header,sizeof(pin_header));
+#endif
+    pin_dirty = 0;
+}
+
+// Pointer into pinned RAM or 0, len is how many bytes follow in the same pin
+uint8_t* pin_find(uint32_t pos, uint8_t* len)
+{
+    if (pin_globals_offset == EMPTY)
+        return 0;
+    uint16_t g = pos - pin_globals_offset;
+    if (pos < 0x10000 && g < sizeof(pin_globals))
     {
-        cache_next++;   // about as good as random..better than lru
-        if (cache_next == LINE_COUNT)
-            cache_next = 0;
-        i = cache_next;
-        if (write_count || !(GET_DIRTY(i)))
-            break;
+        uint16_t n = sizeof(pin_globals) - g;
+        *len = n > 255 ? 255 : n;       // 480 bytes of globals on big parts
+        return pin_globals + g;
     }
-    return i;
+#if HEADER_PINNED
+    if (pos < sizeof(pin_header))
+    {
+        *len = sizeof(pin_header) - pos;
+        return pin_header + pos;
+    }
+#endif
+    return 0;
+}
+
+// A line's copy of any pinned bytes it covers is stale, refresh it before
+// the line is written back. Unaligned globals share lines with other data.
+void pin_overlay(uint32_t a, uint8_t* d, uint8_t len)
+{
+    while (len)
+    {
+        uint8_t n;
+        uint8_t* g = pin_find(a,&n);
+        if (!g)
+            n = 1;
+        else
+        {
+            if (n > len)
+                n = len;
+            memcpy(d,g,n);
+        }
+        a += n;
+        d += n;
+        len -= n;
+    }
+}
+
+zword_t load_global(uint8_t n)
+{
+    if (n < GLOBALS_PINNED && pin_globals_offset != EMPTY)
+    {
+        uint8_t* g = pin_globals + (n << 1);
+        return (g[0] << 8) | g[1];
+    }
+    return get_word(h_globals_offset + (n << 1));
+}
+
+void store_global(uint8_t n, zword_t value)
+{
+    if (n < GLOBALS_PINNED && pin_globals_offset != EMPTY)
+    {
+        uint8_t* g = pin_globals + (n << 1);
+        g[0] = value >> 8;
+        g[1] = value;
+        pin_dirty = 1;
+        return;
+    }
+    set_word(h_globals_offset + (n << 1),value);
 }
 
 // return value TODO
@@ -162,19 +646,38 @@ uint8_t* cache_load(uint32_t pos, uint8_t flag = 0, zword_t value = 0)
 {
     uint16_t p = pos >> LINE_BITS;
     if (!(flag & _STACK))
+    {
+        uint8_t n;
+        uint8_t* g = pin_find(pos,&n);
+        if (g)
+        {
+            if (flag & _WRITE)
+                pin_dirty = 1;
+            return g;
+        }
+#if BLOCK_COUNT > 1
+        if (pos >= h_restart_size)      // read only, skip the lines
+            return blockCache.seek(pos + GAME_REGION_OFFSET);
+#endif
         p += 2048 >> LINE_BITS;
+    }
 
     uint8_t i = cache_last;
     uint8_t m = cache_pos[i] == p;
     if (!m) {
-        for (i = 0; i < LINE_COUNT; i++)
+        uint8_t set = SET_INDEX(p);
+        for (i = set << WAY_BITS; i < (set + 1) << WAY_BITS; i++)
         {
             m = cache_pos[i] == p;
             if (m)
                 break;
         }
-        if (!m)
-            i = cache_getslot();
+        if (!m) {
+            i = cache_getslot(set);
+            if (i == code_slot)
+                code_left = 0;  // evicting the line under the instruction stream
+        }
+        repl_touch(set,i & (WAY_COUNT-1));
         cache_last = i;
     }
     
@@ -186,7 +689,7 @@ uint8_t* cache_load(uint32_t pos, uint8_t flag = 0, zword_t value = 0)
             cache_flush(cache_pos[i] >> (9 - LINE_BITS));
         
         // fill with fresh data
-        memcpy(d,blockCache.seek(((uint32_t)p) << LINE_BITS),LINE_SIZE);
+        blockCache.fill(((uint32_t)p) << LINE_BITS,d,LINE_SIZE);
         cache_pos[i] = p;
     }
     
@@ -203,13 +706,40 @@ uint8_t* cache_load(uint32_t pos, uint8_t flag = 0, zword_t value = 0)
 //=======================================================================
 //=======================================================================
 
+// Sequential fetch runs out of the current line without a probe per byte.
+// A jump, call or ret moves pc away from code_pc and forces a refill.
 zbyte_t read_code_byte (void)
 {
-    return *cache_load((uint32_t)pc++);
+    if (code_left && pc == code_pc)
+    {
+        code_left--;
+        code_pc = ++pc;
+        return *code_ptr++;
+    }
+    uint8_t* d;
+#if BLOCK_COUNT > 1
+    if (pc >= h_restart_size)   // run to the end of the sector
+    {
+        d = blockCache.seek(pc + GAME_REGION_OFFSET);
+        code_slot = CODE_BLOCK | blockCache._last;
+        code_left = PAGE_MASK - (pc & PAGE_MASK);
+    } else
+#endif
+    {
+        d = cache_load((uint32_t)pc);
+        code_slot = cache_last;
+        code_left = LINE_MASK - (pc & LINE_MASK);
+    }
+    code_ptr = d + 1;
+    code_pc = ++pc;
+    return *d;
 }
 
+// Static and high memory are read only, never let them go dirty
 void set_byte(zword_t a,zbyte_t value)
 {
+    if (a >= h_restart_size)
+        return;
     *cache_load(a,_WRITE,value) = value;
 }
 
@@ -241,13 +771,106 @@ void set_word(zword_t a,zword_t value)
     set_byte(a,value);
 }
 
+// Pointer to a run of bytes starting at a, len is set to how many are
+// contiguous in the line. Only good until the next cache access.
+zbyte_t* read_data_span(unsigned long a, zbyte_t* len)
+{
+    uint8_t* g = pin_find(a,len);
+    if (g)
+        return g;
+#if BLOCK_COUNT > 1
+    if (a >= h_restart_size)
+    {
+        uint16_t n = PAGE_SIZE - (a & PAGE_MASK);
+        *len = n > 255 ? 255 : n;
+        return blockCache.seek(a + GAME_REGION_OFFSET);
+    }
+#endif
+    *len = LINE_SIZE - (a & LINE_MASK);
+    if (a < pin_globals_offset && a + *len > pin_globals_offset)
+        *len = pin_globals_offset - a;      // stop short of the pins, the line's copy is stale
+    return cache_load((uint32_t)a);
+}
+
 zword_t read_data_word(unsigned long *a)
 {
+    uint8_t n;
+    uint8_t* d = read_data_span(*a,&n);
+    if (n >= 2)
+    {
+        *a += 2;
+        return (d[0] << 8) | d[1];
+    }
     uint16_t h = read_data_byte(a);
     uint8_t l = read_data_byte(a);
     return (h << 8) | l;
 }
 
+//=======================================================================
+//=======================================================================
+//  Top of the Z-stack lives in RAM. Everything outside the window is in
+//  the stack region of zd.mem, reached through the line cache as before.
+//  The window only moves when sp walks off either end of it.
+
+zword_t stack_load(zword_t i)
+{
+    return *((zword_t*)cache_load(i<<1,_STACK));
+}
+
+void stack_store(zword_t i, zword_t v)
+{
+    *((zword_t*)cache_load(i<<1,_STACK|_WRITE,v)) = v;
+}
+
+// Slide the window to start at base: spill what leaves, fill what arrives
+void stack_move(zword_t base)
+{
+    zword_t old = stack_base;
+    uint8_t j;
+    if (old != STACK_NONE)
+    {
+        for (j = 0; j < STACK_WINDOW; j++)
+            if ((zword_t)(old + j - base) >= STACK_WINDOW)
+                stack_store(old + j,stack_window[j]);
+
+        int d = (int)old - (int)base;
+        if (d > 0 && d < STACK_WINDOW)
+            memmove(stack_window + d,stack_window,(STACK_WINDOW - d)*sizeof(zword_t));
+        else if (d < 0 && -d < STACK_WINDOW)
+            memmove(stack_window,stack_window - d,(STACK_WINDOW + d)*sizeof(zword_t));
+    }
+    for (j = 0; j < STACK_WINDOW; j++)
+        if (old == STACK_NONE || (zword_t)(base + j - old) >= STACK_WINDOW)
+            stack_window[j] = stack_load(base + j);
+    stack_base = base;
+}
+
+// Write the window back to zd.mem, it stays valid
+void stack_spill()
+{
+    if (stack_base == STACK_NONE)
+        return;
+    for (uint8_t j = 0; j < STACK_WINDOW; j++)
+        stack_store(stack_base + j,stack_window[j]);
+}
+
+// Window slot for stack index i or 0 if it lives in zd.mem
+zword_t* stack_find(zword_t i)
+{
+    zword_t k = i - stack_base;
+    if (k < STACK_WINDOW)
+        return stack_window + k;
+    if (i != sp && i != sp - 1)     // POP has already bumped sp
+        return 0;
+
+    // sp left the window, recenter on it
+    zword_t base = i < STACK_WINDOW/2 ? 0 : i - STACK_WINDOW/2;
+    if (base > STACK_SIZE - STACK_WINDOW)
+        base = STACK_SIZE - STACK_WINDOW;
+    stack_move(base);
+    return stack_window + (i - base);
+}
+
 void PUSH(zword_t v)
 {
     STACK(--sp,v);
@@ -260,17 +883,75 @@ zword_t POP()
 
 zword_t STACK(zword_t i)
 {
-    return *((zword_t*)cache_load(i<<1,_STACK));
+    zword_t* w = stack_find(i);
+    return w ? *w : stack_load(i);
 }
 
 void STACK(zword_t i,zword_t v)
 {
-    *((zword_t*)cache_load(i<<1,_STACK|_WRITE,v)) = v;
+    zword_t* w = stack_find(i);
+    if (w)
+        *w = v;
+    else
+        stack_store(i,v);
 }
 
 //=======================================================================
 //=======================================================================
 
+//  Undo. Each save_undo saves to the next manifest of a ring after the
+//  save slots, see save_store: only sectors written since the last one are
+//  looked at. restore_undo pops the newest, so repeating it goes further back.
+//  Without SAVE_POOL there is nowhere to keep them and games are told so.
+
+#if SAVE_POOL
+uint8_t undo_head = UNDO_SLOTS-1;       // newest level
+uint8_t undo_count = 0;
+
+uint8_t save_restore(int slot, bool sav);
+
+void undo_save (void)
+{
+    if (!config_undo) {
+        store_operand((zword_t) -1);
+        return;
+    }
+    uint8_t u = undo_head + 1;
+    if (u == UNDO_SLOTS)
+        u = 0;
+    STACK(16,pc >> 16);                 // where save() keeps them too
+    STACK(17,pc);
+    STACK(18,sp);
+    STACK(19,fp);
+    zword_t status = save_restore(SAVE_SLOTS + u,true);
+    if (status == 0) {
+        undo_head = u;
+        if (undo_count < UNDO_SLOTS)
+            undo_count++;
+    }
+    store_operand(status == 0);
+}
+
+void undo_restore (void)
+{
+    zword_t status = 0;
+    if (!config_undo) {
+        store_operand((zword_t) -1);
+        return;
+    }
+    if (undo_count && save_restore(SAVE_SLOTS + undo_head,false) == 0) {
+        pin_load();                     // lines, pins and stack window now stale
+        pc = STACK(16);
+        pc = (pc << 16) | STACK(17);
+        sp = STACK(18);
+        fp = STACK(19);
+        status = 2;
+        undo_head = undo_head ? undo_head - 1 : UNDO_SLOTS-1;
+        undo_count--;
+    }
+    store_operand(status);
+}
+#else
 void undo_save (void)
 {
     store_operand((zword_t) -1);
@@ -280,6 +961,71 @@ void undo_restore (void)
 {
     store_operand((zword_t) -1);
 }
+#endif
+
+//=======================================================================
+//=======================================================================
+//  Resume on boot. Each line input commits the sectors written since the
+//  last one to the journal (zorkduino.ino), which boot replays. Now and then
+//  a checkpoint copies the journal home. Anything written in place marks
+//  zd.mem dirty until the next checkpoint, as everything is on 2k parts.
+//  Without a journal only a checkpoint makes zd.mem clean again, so 2k parts
+//  take one when the player pauses at a read, not at every read: in steady
+//  play zd.mem goes dirty at the session's first write and stays that way.
+
+uint8_t pagefile_read(pageheader_t* h);
+uint8_t pagefile_write(pageheader_t* h);
+extern uint8_t session_state;
+
+// Mark zd.mem clean, resuming at the read being executed. The block cache
+// must be empty, the entry is edited in sector_data.
+void session_clean()
+{
+    pageheader_t* h = (pageheader_t*)sector_data;
+    pagefile_read(h);
+    h->state = SESSION_CLEAN;
+    h->pc = op_pc;
+    h->sp = op_sp;
+    h->fp = fp;
+    h->journal++;           // its commits are home now
+    pagefile_write(h);
+}
+
+#if !JOURNAL
+unsigned long checkpoint_pc = 0;    // read waiting for a pause, 0 if none
+#endif
+
+void session_checkpoint()
+{
+    if (!config_checkpoint)
+        return;             // write back only on eviction, never resumable
+#if JOURNAL
+    cache_sync();           // to the journal
+    if (session_state != SESSION_DIRTY && !journal_commit(op_pc,op_sp,fp))
+        return;             // the read runs again on resume
+    blockCache.flush();
+    journal_apply(true);
+    session_clean();
+#else
+    checkpoint_pc = op_pc;  // see session_idle
+#endif
+}
+
+#if !JOURNAL
+// The player has paused. If that's at the read that asked for a checkpoint,
+// nothing has run since and zd.mem can be brought up to it.
+void session_idle()
+{
+    if (!checkpoint_pc || checkpoint_pc != op_pc)
+        return;
+    checkpoint_pc = 0;
+    cache_sync();
+    if (session_state == SESSION_DIRTY) {
+        blockCache.flush();
+        session_clean();
+    }
+}
+#endif
 
 //=======================================================================
 //=======================================================================
@@ -289,8 +1035,14 @@ uint8_t pad_until(uint8_t n);
 void pre_input_line();
 
 PROGMEM char s_empty[] = "[EMPTY]";
+#if QUETZAL
+PROGMEM char s_export[] = "[QUETZAL EXPORT]";
+PROGMEM char s_select_save_slot[] = "Select slot for save [0..9,E]: ";
+PROGMEM char s_select_restore_slot[] = "Select slot to restore [0..9,E]: ";
+#else
 PROGMEM char s_select_save_slot[] = "Select slot for save [0..9]: ";
 PROGMEM char s_select_restore_slot[] = "Select slot to restore [0..9]: ";
+#endif
 PROGMEM char s_saving[] = "Saving...";
 PROGMEM char s_restoring[] = "Restoring...";
 PROGMEM char s_wrong_game[] = "This seems to be from a different game...";
@@ -303,10 +1055,16 @@ void note(const char* s)
   new_line();
 }
 
+// The slot directory has an entry per slot: the status bar as it was,
+// score/moves or time, config, checksum and a serial bumped by each save
+// or restore so the latest slot can be marked.
+#define SLOT_ENTRY_SIZE 36
+#define SLOT_CHECKSUM   30
+#define SLOT_SERIAL     32
+
 unsigned long slot_addr(uint8_t i)
 {
-    unsigned long a = i;
-    return (unsigned long)SAVE_REGION_OFFSET + a*(unsigned long)SAVE_SIZE;
+    return ((unsigned long)SLOT_DIR_SECTOR << 9) + i*SLOT_ENTRY_SIZE;
 }
 
 // bypass line cache and use blockcache directly
@@ -317,25 +1075,70 @@ zword_t saved_word(unsigned long* a)
     return (d[1] << 8) | d[0];
 }
 
-void drawslot(uint8_t slot)
+// Slot touched most recently, 0xFF if they are all empty
+uint8_t slot_latest(zword_t* serial)
+{
+    uint8_t latest = 0xFF;
+    *serial = 0;
+    for (uint8_t i = 0; i < SAVE_SLOTS; i++)
+    {
+        unsigned long a = slot_addr(i) + SLOT_CHECKSUM;
+        if (saved_word(&a) == 0)
+            continue;
+        zword_t n = saved_word(&a);
+        if (latest == 0xFF || (int16_t)(n - *serial) > 0) {
+            latest = i;
+            *serial = n;
+        }
+    }
+    return latest;
+}
+
+// Fill in a slot's directory entry from the bottom of the stack, see save()
+void slot_update(uint8_t slot)
+{
+    zword_t w;
+    unsigned long a = slot_addr(slot);
+    for (uint8_t i = 0; i < SLOT_SERIAL/2; i++, a += 2)
+    {
+        w = STACK(i);
+        blockCache.write(a,(uint8_t*)&w,2);
+    }
+    slot_latest(&w);
+    w++;
+    blockCache.write(a,(uint8_t*)&w,2);
+    w = 0;
+    blockCache.write(a + 2,(uint8_t*)&w,2);
+}
+
+#if !SAVE_POOL
+// Mark a slot empty while it is overwritten
+void slot_clear(uint8_t slot)
+{
+    zword_t w = 0;
+    blockCache.write(slot_addr(slot),(uint8_t*)&w,2);
+    blockCache.write(slot_addr(slot) + SLOT_CHECKSUM,(uint8_t*)&w,2);
+}
+#endif
+
+void drawslot(uint8_t slot, uint8_t latest)
 {
     write_char('0'+slot);
-    write_char('.');
+    write_char(slot == latest ? '*' : '.');
     
     unsigned long a = slot_addr(slot);
     zword_t c = 0;
-    for (uint8_t i = 0; i < 12; i++)    // Steal bottom of stack to store save game info
+    for (uint8_t i = 0; i < 12; i++)
     {
         c = saved_word(&a);
         if (c == 0)
-        {
-            write_string(s_empty);
             break;
-        }
         write_char(c);
         write_char(c>>8);
     }
-    if (c) {
+    if (c == 0)
+        write_string(s_empty);
+    else {
         int x = saved_word(&a);
         int y = saved_word(&a);
         int config = saved_word(&a);
@@ -352,20 +1155,29 @@ void drawslot(uint8_t slot)
     new_line();
 }
 
+// One sector read for the lot
 void drawslots()
 {
+    zword_t serial;
+    uint8_t latest = slot_latest(&serial);
     new_line();
     for (int i = 0; i <= 9; i++)
     {
         write_char(' ');
-        drawslot(i);
+        drawslot(i,latest);
     }
+#if QUETZAL
+    write_char(' ');
+    write_char('E');
+    write_char('.');
+    write_string(s_export);
+    new_line();
+#endif
     new_line();
 }
 
 int select_slot(const char* prompt)
 {
-    cache_flush_all();
     drawslots();
     note(prompt);
     pre_input_line();
@@ -375,6 +1187,13 @@ int select_slot(const char* prompt)
         write_char(c);
         return c-'0';
     }
+#if QUETZAL
+    if (c == 'e' || c == 'E')
+    {
+        write_char('E');
+        return SAVE_SLOTS;          // the Quetzal export area
+    }
+#endif
     return -1;
 }
 
@@ -389,25 +1208,13 @@ int store_result(zword_t status, uint8_t v)
 
 extern uint8_t _fdata[TEXT_ROWS*TEXT_COLS];
 
-// Copy using sector buffer
-void save_restore(int slot, bool sav)
+// See save_store and save_load in zdSave.cpp
+uint8_t save_restore(int slot, bool sav)
 {
-    uint8_t n = SAVE_SIZE >> 9;
-    slot = slot*n + (SAVE_REGION_OFFSET >> 9);
-    n = (get_word(H_DATA_SIZE) + 511 + 2048) >> 9;
+    uint16_t n = (h_restart_size + 511 + 2048L) >> 9;  // static memory never leaves the game file
     
     cache_flush_all();
-    for (int s = 0; s < n; s++)
-    {
-        if (sav)
-        {
-            sector_read(s);
-            sector_write(s+slot);
-        } else {
-            sector_read(s+slot);
-            sector_write(s);
-        }
-    }
+    return sav ? save_store(slot,n) : save_load(slot,n);
 }
 
 // 1 ok
@@ -416,6 +1223,14 @@ int save()
 {
     zword_t status = 1;
     int slot = select_slot(s_select_save_slot);
+#if QUETZAL
+    if (slot == SAVE_SLOTS) {
+        note(s_saving);
+        cache_flush_all();
+        cache_init();           // lines hold the frame chain while exporting
+        status = quetzal_export();
+    } else
+#endif
     if (slot >= 0) {
         zword_t cs = get_word(H_CHECKSUM);
         zword_t* sb = (zword_t*)_fdata;     // Copy the status bar
@@ -433,8 +1248,13 @@ int save()
         STACK(i++,fp);                      // 20 stacks slots out of 1024
         
         note(s_saving);
-        save_restore(slot,true);
-        status = 0;
+#if !SAVE_POOL
+        slot_clear(slot);              // written in place, see save_store
+#endif
+        status = save_restore(slot,true);
+        if (status == 0)                    // else the slot keeps its last save
+            slot_update(slot);
+        cache_flush_all();
     }
     return store_result(status,1);
 }
@@ -446,22 +1266,44 @@ int restore()
 {
     zword_t status = 1;
     int slot = select_slot(s_select_restore_slot);
+#if QUETZAL
+    if (slot == SAVE_SLOTS) {
+        note(s_restoring);
+        cache_flush_all();
+        status = quetzal_import();
+        if (status == 2)
+            note(s_wrong_game);
+        cache_flush_all();          // the rebuilt stack
+        pin_load();
+    } else
+#endif
     if (slot >= 0) {
-        unsigned long a = slot_addr(slot) + 30; // checksum
+        unsigned long a = slot_addr(slot) + SLOT_CHECKSUM;
         zword_t cs = saved_word(&a);
+        a = (unsigned long)save_sector(slot,0) << 9;
+        if (a == 0)
+            cs = 0;
         if (cs != get_word(H_CHECKSUM)) {
             if (cs == 0)
                 note(s_empty_slot);
             else
                 note(s_wrong_game);
         } else {
-            pc = saved_word(&a);
-            pc = (pc << 16) | saved_word(&a);
-            sp = saved_word(&a);
-            fp = saved_word(&a);
+            a += 32;                        // saved pc
+            unsigned long p = saved_word(&a);
+            p = (p << 16) | saved_word(&a);
+            zword_t s = saved_word(&a);
+            zword_t f = saved_word(&a);
             note(s_restoring);
-            save_restore(slot,false);
-            status = 0;
+            status = save_restore(slot,false);
+            if (status == 0) {              // else the game carries on as it was
+                pin_load();                 // lines, pins and stack window now stale
+                pc = p;
+                sp = s;
+                fp = f;
+                slot_update(slot);
+                cache_flush_all();
+            }
         }
     }
     return store_result(status,2);
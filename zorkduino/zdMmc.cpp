@@ -15,6 +15,7 @@
 */
 
 #include "Arduino.h"
+#include "ztypes.h"
 #include "zdMmc.h"
 
 #define SPI_PORT  PORTB
@@ -252,30 +253,132 @@ uint8_t MMC_Init()
     return MMC_Release(MMC_Init2());
 }
 
-uint8_t MMC_ReadSector(uint8_t *buffer, uint32_t sector)
+//  Writes return as soon as the card has the data, it keeps programming
+//  with CS high. The busy wait is paid by the next transaction, if at all.
+uint8_t _mmcBusy = 0;
+
+void MMC_WaitBusy()
 {
+    while (SPI_ReceiveByte(0xFF) == 0)
+        ;
+}
+
+#if MMC_ASYNC
+extern volatile uint8_t _asyncState;
+uint8_t MMC_AsyncWait();
+#endif
+
+//  Address the card, finishing any write still programming
+uint8_t MMC_Select(uint32_t* sector)
+{
+#if MMC_ASYNC
+    MMC_AsyncWait();
+#endif
     if (!(_mmcState & MMC_INITED))
         return MMC_NOT_INITED;
     if (!(_mmcState & MMC_HIGH_DENSITY))
-        sector <<= 9;
+        *sector <<= 9;
     SPI_Enable();
     MMC_SS_LOW();
+    if (_mmcBusy)
+    {
+        MMC_WaitBusy();
+        _mmcBusy = 0;
+    }
+    return 0;
+}
+
+//  Nonzero while the last write is still programming. Cheap, call when idle.
+uint8_t MMC_Busy()
+{
+#if MMC_ASYNC
+    if (_asyncState)
+        return _mmcBusy;    // the bus is taken
+#endif
+    if (_mmcBusy)
+    {
+        SPI_Enable();
+        MMC_SS_LOW();
+        if (SPI_ReceiveByte(0xFF) != 0)
+            _mmcBusy = 0;
+        MMC_Release(0);
+    }
+    return _mmcBusy;
+}
+
+uint8_t MMC_ReadSector(uint8_t *buffer, uint32_t sector)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
     if (MMC_Command(17,sector) != 0 || MMC_Token() != 0xFE)
         return MMC_Release(READ_FAILED);
     SPI_Receive(buffer,512);    // WARNING! Will strip 2 CRC bytes as well
     return MMC_Release(0);
 }
 
-uint8_t MMC_WriteSector(uint8_t *buffer, uint32_t sector)
+//  Read len bytes at offset within a sector, clocking past the rest
+//  Lets a cache line be filled without a 512 byte buffer
+uint8_t MMC_ReadSectorPart(uint8_t *buffer, uint32_t sector, uint16_t offset, uint16_t len)
 {
-    if (!(_mmcState & MMC_INITED))
-        return MMC_NOT_INITED;
-    if (!(_mmcState & MMC_HIGH_DENSITY))
-        sector <<= 9;
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    if (MMC_Command(17,sector) != 0 || MMC_Token() != 0xFE)
+        return MMC_Release(READ_FAILED);
+    uint16_t n = 512 + 2 - offset - len;  // rest of the data plus 2 CRC bytes
+    while (offset--)
+        SPI_ReceiveByte(0xFF);
+    while (len--)
+        *buffer++ = SPI_ReceiveByte(0xFF);
+    while (n--)
+        SPI_ReceiveByte(0xFF);
+    return MMC_Release(0);
+}
 
-    uint8_t r = WRITE_FAILED;
-    SPI_Enable();
-    MMC_SS_LOW();
+// Read a sector comparing it with buffer as it arrives, same is 0 if they differ
+uint8_t MMC_CompareSector(uint8_t *buffer, uint32_t sector, uint8_t* same)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    if (MMC_Command(17,sector) != 0 || MMC_Token() != 0xFE)
+        return MMC_Release(READ_FAILED);
+    uint8_t d = 0;
+    uint16_t n = 512;
+    while (n--)
+        d |= SPI_ReceiveByte(0xFF) ^ *buffer++;
+    SPI_ReceiveByte(0xFF);  // CRC
+    SPI_ReceiveByte(0xFF);
+    *same = d == 0;
+    return MMC_Release(0);
+}
+
+// Read len bytes from offset, XORing them into buffer
+uint8_t MMC_XorSectorPart(uint8_t *buffer, uint32_t sector, uint16_t offset, uint16_t len)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    if (MMC_Command(17,sector) != 0 || MMC_Token() != 0xFE)
+        return MMC_Release(READ_FAILED);
+    uint16_t n = 512 + 2 - offset - len;
+    while (offset--)
+        SPI_ReceiveByte(0xFF);
+    while (len--)
+        *buffer++ ^= SPI_ReceiveByte(0xFF);
+    while (n--)
+        SPI_ReceiveByte(0xFF);
+    return MMC_Release(0);
+}
+
+// Write len bytes and zero fill the rest of the sector
+uint8_t MMC_WriteSectorPart(uint8_t *buffer, uint32_t sector, uint16_t len)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    r = WRITE_FAILED;
     if (MMC_Command2(24,sector) != 0)
     {
         uint8_t d = 16;
@@ -284,7 +387,10 @@ uint8_t MMC_WriteSector(uint8_t *buffer, uint32_t sector)
 
         SPI_ReceiveByte(0xFE);  // Send token
 
-        SPI_Send(buffer,512);
+        SPI_Send(buffer,len);
+        len = 512 - len;
+        while (len--)
+            SPI_ReceiveByte(0);
         SPI_ReceiveByte(0xFF);  // CRC
         SPI_ReceiveByte(0xFF);  // CRC
 
@@ -296,11 +402,214 @@ uint8_t MMC_WriteSector(uint8_t *buffer, uint32_t sector)
         else
             r = status;
 
-        while (SPI_ReceiveByte(0xFF) == 0)
-            ;
+        _mmcBusy = 1;           // don't wait for programming to finish
         r = MMC_Release(r);
     } else {
         r = MMC_Release(WRITE_FAILED);
     }
     return r;
 }
+
+uint8_t MMC_WriteSector(uint8_t *buffer, uint32_t sector)
+{
+    return MMC_WriteSectorPart(buffer,sector,512);
+}
+
+//======================================================================================================
+//======================================================================================================
+//  Multi-block transfers. One command for a run of sectors instead of one each.
+//  CS stays low from Start to Stop, nothing else may use the SPI in between.
+
+uint8_t MMC_ReadStart(uint32_t sector)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    if (MMC_Command(18,sector) != 0)    // READ_MULTIPLE_BLOCK
+        return MMC_Release(READ_FAILED);
+    return 0;
+}
+
+//  A failed block still ends the transfer, the card would otherwise keep
+//  streaming into whatever command comes next
+uint8_t MMC_ReadNext(uint8_t *buffer)
+{
+    if (MMC_Token() != 0xFE)
+    {
+        MMC_ReadStop();
+        return READ_FAILED;
+    }
+    SPI_Receive(buffer,512);    // WARNING! Will strip 2 CRC bytes as well
+    return 0;
+}
+
+uint8_t MMC_ReadStop()
+{
+    MMC_Command2(12,0);         // STOP_TRANSMISSION
+    SPI_ReceiveByte(0xFF);      // stuff byte
+    MMC_Token();
+    MMC_WaitBusy();
+    return MMC_Release(0);
+}
+
+//  count lets the card pre-erase (ACMD23), it is only a hint
+uint8_t MMC_WriteStart(uint32_t sector, uint16_t count)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    MMC_Command(55,0);          // SEND_APP_CMD
+    MMC_Command(23,count);      // SET_WR_BLK_ERASE_COUNT
+    if (MMC_Command(25,sector) != 0)    // WRITE_MULTIPLE_BLOCK
+        return MMC_Release(WRITE_FAILED);
+    return 0;
+}
+
+uint8_t MMC_WriteNext(uint8_t *buffer)
+{
+    SPI_ReceiveByte(0xFF);      // pad
+    SPI_ReceiveByte(0xFC);      // Multi-block data token
+    SPI_Send(buffer,512);
+    SPI_ReceiveByte(0xFF);      // CRC
+    SPI_ReceiveByte(0xFF);      // CRC
+
+    uint8_t status;
+    while ((status = SPI_ReceiveByte(0xFF)) == 0xFF)
+        ;
+    MMC_WaitBusy();
+    if ((status & 0x1F) != 0x05)
+    {
+        MMC_WriteStop();
+        return WRITE_FAILED;
+    }
+    return 0;
+}
+
+uint8_t MMC_WriteStop()
+{
+    SPI_ReceiveByte(0xFF);      // pad
+    SPI_ReceiveByte(0xFD);      // Stop token
+    SPI_ReceiveByte(0xFF);
+    _mmcBusy = 1;
+    return MMC_Release(0);
+}
+
+//======================================================================================================
+//======================================================================================================
+//  Background single sector read, driven by the SPI interrupt. The command goes
+//  out polled, the ISR then waits for the data token and clocks in the block.
+//  Any foreground transaction waits for it in MMC_Select.
+//  The video ISR holds the transfer during active lines, like the PS2
+//  keyboard, so a byte interrupt can never delay the start of a scanline.
+//  Waiting for a held transfer takes it over and finishes it polled.
+
+#if MMC_ASYNC
+
+#define ASYNC_IDLE    0
+#define ASYNC_TOKEN   1
+#define ASYNC_DATA    2
+#define ASYNC_CRC     3
+#define ASYNC_RELEASE 4
+
+volatile uint8_t _asyncState = ASYNC_IDLE;
+uint8_t* volatile _asyncPtr;
+volatile uint16_t _asyncCount;
+volatile uint8_t _asyncResult;
+volatile uint8_t _asyncIrq;     // ISR drives the transfer, not the foreground
+volatile uint8_t _asyncHeld;    // active video
+
+// One byte of the transfer has arrived
+static void MMC_AsyncStep()
+{
+    uint8_t b = SPDR;
+    switch (_asyncState)
+    {
+        case ASYNC_TOKEN:
+            if (b == 0xFE)
+            {
+                _asyncState = ASYNC_DATA;
+                _asyncCount = 512;
+            } else if (b != 0xFF || --_asyncCount == 0) {
+                _asyncResult = READ_FAILED;
+                _asyncState = ASYNC_RELEASE;
+                MMC_SS_HIGH();
+            }
+            break;
+        case ASYNC_DATA:
+            *_asyncPtr++ = b;
+            if (--_asyncCount == 0)
+            {
+                _asyncState = ASYNC_CRC;
+                _asyncCount = 2;
+            }
+            break;
+        case ASYNC_CRC:
+            if (--_asyncCount == 0)
+            {
+                _asyncState = ASYNC_RELEASE;
+                MMC_SS_HIGH();      // one more clock flushes the CS release
+            }
+            break;
+        default:
+            SPI_Disable();          // also clears SPIE
+            _asyncIrq = 0;
+            _asyncState = ASYNC_IDLE;
+            return;
+    }
+    SPDR = 0xFF;
+}
+
+ISR(SPI_STC_vect)
+{
+    MMC_AsyncStep();
+}
+
+//  Called from the video ISR as active lines start (1) and end (0)
+void MMC_AsyncHold(uint8_t hold)
+{
+    _asyncHeld = hold;
+    if (hold)
+        SPCR &= ~_BV(SPIE);
+    else if (_asyncIrq)
+        SPCR |= _BV(SPIE);      // a byte that landed meanwhile interrupts at once
+}
+
+uint8_t MMC_ReadSectorAsync(uint8_t *buffer, uint32_t sector)
+{
+    uint8_t r = MMC_Select(&sector);
+    if (r)
+        return r;
+    if (MMC_Command(17,sector) != 0)
+        return MMC_Release(READ_FAILED);
+    _asyncPtr = buffer;
+    _asyncCount = 0x3FFF;
+    _asyncResult = 0;
+    _asyncState = ASYNC_TOKEN;
+    uint8_t sreg = SREG;
+    cli();
+    _asyncIrq = 1;
+    SPCR = 0x50 | 0x01 | (_asyncHeld ? 0 : _BV(SPIE));  // f/8 with SPI2X, leaves the cpu time between bytes
+    SPDR = 0xFF;
+    SREG = sreg;
+    return 0;
+}
+
+//  Result of the last background read once it is done
+uint8_t MMC_AsyncWait()
+{
+    if (_asyncState == ASYNC_IDLE)
+        return _asyncResult;
+    uint8_t sreg = SREG;
+    cli();
+    _asyncIrq = 0;
+    SPCR &= ~_BV(SPIE);
+    SREG = sreg;
+    while (_asyncState != ASYNC_IDLE)
+    {
+        loop_until_bit_is_set(SPSR, SPIF);
+        MMC_AsyncStep();
+    }
+    return _asyncResult;
+}
+
+#endif
@@ -25,6 +25,34 @@
 #define WRITE_FAILED      8
 #define READ_FAILED       9
 
+//  Background sector reads. Needs a spare block buffer to read into, so not
+//  on 2k parts. They only run outside active video lines, see MMC_AsyncHold
+#ifndef MMC_ASYNC
+#if BIG_RAM
+#define MMC_ASYNC 1
+#else
+#define MMC_ASYNC 0
+#endif
+#endif
+
 uint8_t MMC_Init();
 uint8_t MMC_ReadSector(uint8_t *buffer, uint32_t sector);
+uint8_t MMC_ReadSectorPart(uint8_t *buffer, uint32_t sector, uint16_t offset, uint16_t len);
 uint8_t MMC_WriteSector(uint8_t *buffer, uint32_t sector);
+uint8_t MMC_WriteSectorPart(uint8_t *buffer, uint32_t sector, uint16_t len);
+uint8_t MMC_CompareSector(uint8_t *buffer, uint32_t sector, uint8_t* same);
+uint8_t MMC_XorSectorPart(uint8_t *buffer, uint32_t sector, uint16_t offset, uint16_t len);
+uint8_t MMC_Busy();
+
+uint8_t MMC_ReadStart(uint32_t sector);
+uint8_t MMC_ReadNext(uint8_t *buffer);
+uint8_t MMC_ReadStop();
+uint8_t MMC_WriteStart(uint32_t sector, uint16_t count);
+uint8_t MMC_WriteNext(uint8_t *buffer);
+uint8_t MMC_WriteStop();
+
+#if MMC_ASYNC
+uint8_t MMC_ReadSectorAsync(uint8_t *buffer, uint32_t sector);
+uint8_t MMC_AsyncWait();
+void MMC_AsyncHold(uint8_t hold);
+#endif
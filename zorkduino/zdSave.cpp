@@ -0,0 +1,944 @@
+
+/* Copyright (c) 2010-2014, Peter Barrett  
+**  
+** Permission to use, copy, modify, and/or distribute this software for  
+** any purpose with or without fee is hereby granted, provided that the  
+** above copyright notice and this permission notice appear in all copies.  
+**  
+** THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL  
+** WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED  
+** WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR  
+** BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES  
+** OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,  
+** WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,  
+** ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS  
+** SOFTWARE.  
+*/
+
+#include <stddef.h>
+#include "Arduino.h"
+#include "ztypes.h"
+#include "zdMmc.h"
+#include "zdThin.h"
+
+//================================================================================
+//================================================================================
+//  Save slots. A slot is a manifest naming, for each stack and dynamic memory
+//  sector, either a sector in a pool shared by all slots or the story file's
+//  own copy. Pool sectors are content addressed: a sector's hash picks where
+//  probing starts, so an identical sector already in the pool is found and
+//  shared rather than written again. Sectors written since the last save or
+//  restore are tracked against that slot, so only those are looked at next.
+//  Without SAVE_POOL a slot is a plain copy, see the end of the file.
+
+uint8_t* block_buffer(uint8_t i);  // zdIO.cpp
+
+extern uint8_t sector_data[512];   // zorkduino.ino
+
+#if WRITE_TRACKING
+uint8_t page_written[(GAME_SLOT_SECTORS + 7) >> 3];
+uint8_t page_slot = 0xFF;     // save slot that matched when tracking started
+
+void page_mark(uint16_t sector)
+{
+    if (sector < GAME_SLOT_SECTORS)
+        page_written[sector >> 3] |= 1 << (sector & 7);
+}
+
+inline bool page_dirty(uint16_t sector)
+{
+    return page_written[sector >> 3] & (1 << (sector & 7));
+}
+
+// Start tracking again against a slot, 0xFF for none
+void page_track(uint8_t slot)
+{
+    memset(page_written,0,sizeof(page_written));
+    page_slot = slot;
+}
+#else
+const uint8_t page_slot = 0xFF;   // never matches, so every sector is looked at
+inline bool page_dirty(uint16_t) { return true; }
+#endif
+
+#if SAVE_POOL
+
+#define MANIFEST_MAGIC    0x4D53    // "SM"
+#define MANIFEST_ENTRIES  32
+#define PRISTINE          0xFFFF    // same as the story file
+
+typedef struct {
+    uint16_t magic;                 // first sector only
+    uint16_t count;
+    uint16_t serial;                // newer of a save slot's two manifests
+    uint16_t filler;
+    uint16_t entry[MANIFEST_ENTRIES];
+} Manifest;
+
+typedef char manifest_fits[MANIFEST_SECTORS*MANIFEST_ENTRIES >= GAME_SLOT_SECTORS ? 1 : -1];
+typedef char pool_fits[POOL_SECTORS/8 <= 512 ? 1 : -1];
+
+uint8_t manifest_read(uint16_t base, uint8_t k, Manifest* m)
+{
+    return MMC_ReadSectorPart((uint8_t*)m,sector_mem(base + k),0,sizeof(Manifest));
+}
+
+uint8_t manifest_write(uint16_t base, uint8_t k, Manifest* m)
+{
+    audio_beep(DISKBEEP_FREQ,16);
+    return MMC_WriteSectorPart((uint8_t*)m,sector_mem(base + k),sizeof(Manifest));
+}
+
+// magic, count and serial of a manifest, magic 0 if unreadable
+void manifest_header(uint16_t base, uint16_t* h)
+{
+    if (MMC_ReadSectorPart((uint8_t*)h,sector_mem(base),0,3*sizeof(uint16_t)))
+        h[0] = 0;
+}
+
+// First sector of the manifest holding a slot's save, or of the one the next
+// save goes to. Of a save slot's two the newer valid one holds the save.
+uint16_t manifest_sector(uint8_t slot, bool next)
+{
+    uint16_t a[3],b[3];
+    if (slot >= SAVE_SLOTS)
+        return MANIFEST_SECTOR(slot);    // undo levels have just the one
+    manifest_header(MANIFEST_SECTOR(slot),a);
+    manifest_header(SHADOW_SECTOR(slot),b);
+    bool shadow = b[0] == MANIFEST_MAGIC && (a[0] != MANIFEST_MAGIC || (int16_t)(b[2] - a[2]) > 0);
+    return shadow != next ? SHADOW_SECTOR(slot) : MANIFEST_SECTOR(slot);
+}
+
+// Number of sectors saved in a manifest, 0 if empty
+uint16_t manifest_count(uint16_t base)
+{
+    uint16_t h[3];
+    manifest_header(base,h);
+    return h[0] == MANIFEST_MAGIC ? h[1] : 0;
+}
+
+// zd.mem sector holding sector i of a save, 0 if there is none
+uint16_t save_sector(uint8_t slot, uint16_t i)
+{
+    uint16_t e;
+    uint16_t base = manifest_sector(slot,false);
+    if (i >= manifest_count(base) ||
+        MMC_ReadSectorPart((uint8_t*)&e,sector_mem(base + i/MANIFEST_ENTRIES),
+            offsetof(Manifest,entry) + (i % MANIFEST_ENTRIES)*sizeof(e),sizeof(e)) || e == PRISTINE)
+        return 0;
+    return POOL_SECTOR + e;
+}
+
+// Pool sectors named by any manifest and the manifest being read or
+// written, in spare block buffers while saving or restoring
+uint8_t* pool_live;
+#define MANIFEST ((Manifest*)block_buffer(2))
+
+void pool_scan()
+{
+    Manifest* m = MANIFEST;
+    memset(pool_live,0,POOL_SECTORS/8);
+    for (uint8_t slot = 0; slot < SAVE_SLOTS + UNDO_SLOTS; slot++)
+    {
+        uint16_t base = manifest_sector(slot,false);
+        uint16_t n = manifest_count(base);
+        for (uint16_t i = 0; i < n; i++)
+        {
+            if (i % MANIFEST_ENTRIES == 0 && manifest_read(base,i/MANIFEST_ENTRIES,m))
+                break;
+            uint16_t e = m->entry[i % MANIFEST_ENTRIES];
+            if (e < POOL_SECTORS)
+                pool_live[e >> 3] |= 1 << (e & 7);
+        }
+    }
+}
+
+// POOL_LIVE_SECTOR keeps the bitmap between saves as free bits, so one never
+// written has nothing free. Sectors a save stops naming stay marked; only
+// once fewer than n are free does a save scan every manifest again.
+void pool_load(uint16_t n)
+{
+    uint16_t free = 0;
+    if (MMC_ReadSectorPart(pool_live,sector_mem(POOL_LIVE_SECTOR),0,POOL_SECTORS/8))
+        memset(pool_live,0,POOL_SECTORS/8);
+    for (uint8_t i = 0; i < POOL_SECTORS/8; i++)
+    {
+        for (uint8_t b = pool_live[i]; b; b &= b - 1)
+            free++;
+        pool_live[i] = ~pool_live[i];
+    }
+    if (free < n)
+        pool_scan();
+}
+
+uint8_t pool_save()
+{
+    for (uint8_t i = 0; i < POOL_SECTORS/8; i++)
+        pool_live[i] = ~pool_live[i];
+    return MMC_WriteSectorPart(pool_live,sector_mem(POOL_LIVE_SECTOR),POOL_SECTORS/8);
+}
+
+uint16_t sector_hash(const uint8_t* d)
+{
+    uint16_t h = 5381;
+    for (uint16_t i = 0; i < 512; i++)
+        h = (h << 5) + h + *d++;
+    return h;
+}
+
+// Pool sector holding sector_data, storing it if it isn't there yet.
+// Probing stops at the first free sector, PRISTINE if the pool is full.
+uint16_t pool_put()
+{
+    uint16_t p = sector_hash(sector_data) & (POOL_SECTORS-1);
+    for (uint16_t i = 0; i < POOL_SECTORS; i++, p = (p + 1) & (POOL_SECTORS-1))
+    {
+        uint32_t s = sector_mem(POOL_SECTOR + p);
+        uint8_t same;
+        if (!(pool_live[p >> 3] & (1 << (p & 7)))) {
+            audio_beep(DISKBEEP_FREQ,16);
+            if (MMC_WriteSector(sector_data,s))
+                break;
+            pool_live[p >> 3] |= 1 << (p & 7);
+            return p;
+        }
+        if (MMC_CompareSector(sector_data,s,&same))
+            break;
+        if (same)
+            return p;
+    }
+    return PRISTINE;
+}
+
+// Save n stack and dynamic memory sectors to a slot, nonzero on failure.
+// Unwritten sectors are named as in the slot that last matched, so saving
+// to another one (the undo ring) doesn't look at them either. A save slot's
+// new manifest goes in its other one and its header is written last, so a
+// save that fails leaves the last one there; an undo level is just lost.
+// The block cache must be flushed.
+uint8_t save_store(uint8_t slot, uint16_t n)
+{
+    Manifest* m = MANIFEST;
+    uint8_t r = 0;
+    uint16_t from = page_slot != 0xFF ? manifest_sector(page_slot,false) : 0;
+    uint16_t base = manifest_sector(slot,true);
+    bool known = from && manifest_count(from) == n;
+    pool_live = block_buffer(1);
+    pool_load(n);
+    for (uint16_t i = 0; i < n && !r; i++)
+    {
+        uint8_t k = i % MANIFEST_ENTRIES;
+        if (k == 0 && (!known || (r = manifest_read(from,i/MANIFEST_ENTRIES,m))))
+            memset(m,0,sizeof(Manifest));
+        if (known && !page_dirty(i))
+            ;                             // unchanged since the slot matched
+        else if (!(r = MMC_ReadSector(sector_data,sector_mem(i))))
+        {
+            uint8_t same = 0;
+            if (i >= GAME_SECTOR)
+                r = MMC_CompareSector(sector_data,map_sector(&game_map,i - GAME_SECTOR),&same);
+            if (same)
+                m->entry[k] = PRISTINE;
+            else if (!r && (m->entry[k] = pool_put()) == PRISTINE)
+                r = 1;                    // pool is full
+        }
+        if (!r && (k == MANIFEST_ENTRIES-1 || i == n-1)) {
+            m->magic = 0;                  // not a save until the header lands
+            r = manifest_write(base,i/MANIFEST_ENTRIES,m);
+        }
+    }
+    uint16_t h[3];
+    manifest_header(manifest_sector(slot,false),h);
+    if (!r && !(r = pool_save()) && !(r = manifest_read(base,0,m)))
+    {
+        m->magic = MANIFEST_MAGIC;        // the bitmap already names its sectors
+        m->count = n;
+        m->serial = h[0] == MANIFEST_MAGIC ? h[2] + 1 : 0;
+        r = manifest_write(base,0,m);
+    }
+    page_track(r ? 0xFF : slot);
+    return r;
+}
+
+// Nonzero unless a slot holds n sectors, each in the story or the pool
+uint8_t manifest_check(uint16_t base, uint16_t n, Manifest* m)
+{
+    if (manifest_count(base) != n)
+        return 1;
+    for (uint16_t i = 0; i < n; i++)
+    {
+        if (i % MANIFEST_ENTRIES == 0 && manifest_read(base,i/MANIFEST_ENTRIES,m))
+            return 1;
+        uint16_t e = m->entry[i % MANIFEST_ENTRIES];
+        if (e != PRISTINE && e >= POOL_SECTORS)
+            return 1;
+    }
+    return 0;
+}
+
+// Restore n stack and dynamic memory sectors from a slot, writing only
+// the ones that differ. The manifest is checked first, so unless the
+// card fails midway nothing is written if it can't be restored.
+uint8_t save_load(uint8_t slot, uint16_t n)
+{
+    Manifest* m = MANIFEST;
+    uint8_t r = 0;
+    uint8_t k = 0xFF;
+    bool known = page_slot == slot;
+    uint16_t base = manifest_sector(slot,false);
+    if (manifest_check(base,n,m))
+        return 1;
+    for (uint16_t i = 0; i < n && !r; i++)
+    {
+        if (known && !page_dirty(i))
+            continue;
+        if (k != i/MANIFEST_ENTRIES && (r = manifest_read(base,k = i/MANIFEST_ENTRIES,m)))
+            break;
+        uint16_t e = m->entry[i % MANIFEST_ENTRIES];
+        uint32_t s = e == PRISTINE ? map_sector(&game_map,i - GAME_SECTOR) : sector_mem(POOL_SECTOR + e);
+        uint8_t same;
+        if (!(r = MMC_ReadSector(sector_data,s)) &&
+            !(r = MMC_CompareSector(sector_data,sector_mem(i),&same)) && !same)
+        {
+            session_dirty(i);
+            audio_beep(DISKBEEP_FREQ,16);
+            r = MMC_WriteSector(sector_data,sector_mem(i));
+        }
+    }
+    page_track(r ? 0xFF : slot);
+    return r;
+}
+
+#else
+
+//  Without SAVE_POOL each save slot is a fixed copy of the stack and dynamic
+//  memory. A save overwrites it in place, so one that fails leaves the slot
+//  half written: save() empties its directory entry first.
+
+// zd.mem sector holding sector i of a save
+uint16_t save_sector(uint8_t slot, uint16_t i)
+{
+    return SAVE_SLOT_SECTOR(slot) + i;
+}
+
+// Bring n zd.mem sectors at dst up to date with src, writing only the
+// ones that differ. Unless tracking says otherwise each is compared.
+uint8_t sector_sync(uint16_t dst, uint16_t src, uint16_t n, uint8_t slot)
+{
+    uint8_t r = 0;
+    bool known = page_slot == slot;
+    for (uint16_t i = 0; i < n && !r; i++)
+    {
+        uint8_t same;
+        if (known && !page_dirty(i))
+            continue;
+        if (!(r = MMC_ReadSector(sector_data,sector_mem(src + i))) &&
+            !(r = MMC_CompareSector(sector_data,sector_mem(dst + i),&same)) && !same)
+        {
+            session_dirty(dst + i);
+            audio_beep(DISKBEEP_FREQ,16);
+            r = MMC_WriteSector(sector_data,sector_mem(dst + i));
+        }
+    }
+    page_track(r ? 0xFF : slot);
+    return r;
+}
+
+uint8_t save_store(uint8_t slot, uint16_t n)
+{
+    return sector_sync(SAVE_SLOT_SECTOR(slot),0,n,slot);
+}
+
+uint8_t save_load(uint8_t slot, uint16_t n)
+{
+    return sector_sync(0,SAVE_SLOT_SECTOR(slot),n,slot);
+}
+#endif
+
+//================================================================================
+//================================================================================
+//  Journal. Between checkpoints stack and dynamic memory sectors are written
+//  to the journal rather than in place, and each line read appends a commit
+//  naming them, with the pc, sp and fp to resume at. zd.mem itself is left
+//  as of the last checkpoint, so its catalog entry stays clean; boot replays
+//  the commits that landed and power lost mid turn costs only that turn.
+//  When the journal fills, a checkpoint copies it home. 2k parts don't
+//  journal (see JOURNAL): a turn that writes marks zd.mem dirty until the
+//  player next pauses at a line read, power lost before that leaves
+//  nothing to resume.
+
+#if JOURNAL
+
+extern uint8_t config_checkpoint;   // zdIO.cpp
+extern uint8_t game_slot;           // zorkduino.ino
+
+// Stack and dynamic memory sectors in the journal since the last checkpoint,
+// with where the newest copy of each is
+#define JOURNAL_MAP 32
+
+typedef struct {
+    uint8_t sector;
+    uint8_t pos;
+} JournalEntry;
+
+JournalEntry journal_map[JOURNAL_MAP];
+uint8_t journal_mapped = 0;
+uint8_t journal_pos = 0;        // next free journal sector
+uint8_t journal_start = 0;      // first not yet committed
+uint16_t journal_seq = 0;
+uint16_t journal_used;          // catalog entry's used and journal, see JournalCommit
+uint8_t journal_epoch;
+
+uint8_t journal_find(uint16_t sector)
+{
+    for (uint8_t i = 0; i < journal_mapped; i++)
+        if (journal_map[i].sector == sector)
+            return i;
+    return 0xFF;
+}
+
+// zd.mem sector holding the newest copy of a journaled sector, 0 if none
+uint16_t journal_sector(uint16_t sector)
+{
+    uint8_t j = journal_find(sector);
+    return j == 0xFF ? 0 : JOURNAL_SECTOR + journal_map[j].pos;
+}
+
+#define JOURNAL_MAGIC 0x524A    // "JR"
+#define JOURNAL_BATCH 32        // sectors a commit can name
+#define SUPERSEDED    0xFF
+
+typedef struct {
+    uint16_t magic;
+    uint16_t used;      // the catalog entry's used and journal when written,
+    uint8_t epoch;      // a checkpoint or a new pick invalidates the journal
+    uint8_t slot;
+    uint16_t seq;
+    unsigned long pc;
+    uint16_t sp;
+    uint16_t fp;
+    uint8_t count;      // journal sectors just ahead of this one
+    uint8_t filler;
+    uint16_t sum;
+    uint8_t target[JOURNAL_BATCH]; // where each goes, SUPERSEDED if written again
+} JournalCommit;
+
+uint16_t journal_sum(JournalCommit* c)
+{
+    uint16_t s = c->sum;
+    c->sum = 0;
+    uint16_t h = 5381;
+    const uint8_t* d = (const uint8_t*)c;
+    for (uint8_t i = 0; i < sizeof(JournalCommit); i++)
+        h = (h << 5) + h + *d++;
+    c->sum = s;
+    return h;
+}
+
+// Write a stack or dynamic memory sector to the journal, nonzero if it has
+// to be written in place instead
+uint8_t journal_put(uint16_t sector, uint8_t* data)
+{
+    if (!config_checkpoint || sector >= CATALOG_SECTOR)
+        return 1;
+    uint8_t j = journal_find(sector);
+    if (journal_pos >= JOURNAL_SECTORS-1 || journal_pos - journal_start >= JOURNAL_BATCH ||
+        (j == 0xFF && journal_mapped == JOURNAL_MAP) ||
+        MMC_WriteSector(data,sector_mem(JOURNAL_SECTOR + journal_pos)))
+    {
+        if (j != 0xFF)
+            journal_map[j] = journal_map[--journal_mapped]; // the copy in place is newer
+        return 1;
+    }
+    written_mark(sector);
+    page_mark(sector);
+    if (j == 0xFF) {
+        j = journal_mapped++;
+        journal_map[j].sector = sector;
+    }
+    journal_map[j].pos = journal_pos++;
+    return 0;
+}
+
+// Commit what was journaled since the last commit, to resume at pc, sp and
+// fp. Nonzero if it's time to checkpoint.
+uint8_t journal_commit(unsigned long pc, uint16_t sp, uint16_t fp)
+{
+    uint8_t n = journal_pos - journal_start;
+    if (n)
+    {
+        JournalCommit c;
+        memset(&c,0,sizeof(c));
+        c.magic = JOURNAL_MAGIC;
+        c.used = journal_used;
+        c.epoch = journal_epoch;
+        c.slot = game_slot;
+        c.seq = journal_seq;
+        c.pc = pc;
+        c.sp = sp;
+        c.fp = fp;
+        c.count = n;
+        memset(c.target,SUPERSEDED,n);
+        for (uint8_t i = 0; i < journal_mapped; i++)
+            if (journal_map[i].pos >= journal_start)
+                c.target[journal_map[i].pos - journal_start] = journal_map[i].sector;
+        c.sum = journal_sum(&c);
+        if (MMC_WriteSectorPart((uint8_t*)&c,sector_mem(JOURNAL_SECTOR + journal_pos),sizeof(c)))
+            return 1;
+        journal_start = ++journal_pos;
+        journal_seq++;
+    }
+    return journal_pos > JOURNAL_SECTORS/2 || journal_mapped > JOURNAL_MAP/2;
+}
+
+// Copy the journal home and empty it, with the block cache flushed. Unless
+// it's a checkpoint straight after a commit zd.mem is then in no state a
+// commit describes, so is dirty until the next checkpoint.
+uint8_t journal_apply(bool checkpoint)
+{
+    uint8_t r = 0;
+    if (journal_pos && (!checkpoint || journal_pos != journal_start))
+        session_dirty(0);
+    for (uint8_t i = 0; i < journal_mapped && !r; i++)
+        r = copy_sectors(sector_mem(journal_map[i].sector),sector_mem(JOURNAL_SECTOR + journal_map[i].pos),1);
+    journal_mapped = journal_pos = journal_start = 0;
+    journal_seq = 0;
+    return r;
+}
+
+// At boot, bring zd.mem up to the last commit after the checkpoint in h,
+// leaving h to resume there. Commits have to follow one another with the
+// sectors they name just ahead, so the first that didn't land ends it.
+uint8_t journal_replay(pageheader_t* h)
+{
+    JournalCommit c;
+    uint8_t start = 0;
+    uint16_t seq = 0;
+    for (uint8_t pos = 0; pos < JOURNAL_SECTORS && pos - start <= JOURNAL_BATCH; pos++)
+    {
+        if (MMC_ReadSectorPart((uint8_t*)&c,sector_mem(JOURNAL_SECTOR + pos),0,sizeof(c)))
+            return 1;
+        if (c.magic != JOURNAL_MAGIC || c.used != h->used || c.epoch != h->journal ||
+            c.slot != game_slot || c.seq != seq || c.sum != journal_sum(&c))
+            continue;
+        if (c.count != pos - start)
+            break;
+        for (uint8_t i = 0; i < c.count; i++)
+        {
+            if (c.target[i] == SUPERSEDED)
+                continue;
+            written_mark(c.target[i]);
+            if (copy_sectors(sector_mem(c.target[i]),sector_mem(JOURNAL_SECTOR + start + i),1))
+                return 1;
+        }
+        h->pc = c.pc;
+        h->sp = c.sp;
+        h->fp = c.fp;
+        start = pos + 1;
+        seq++;
+    }
+    return 0;
+}
+#endif
+
+#if QUETZAL
+
+//================================================================================
+//================================================================================
+//  Quetzal saves. One IFZS file at a time lives in zd.mem's export area,
+//  where tools/zdsave.cpp on the host can take it away or drop one in.
+//  Dynamic memory is XOR-RLE compressed against the story file (CMem) and
+//  the stack is written as Quetzal frames (Stks). Input comes a chunk at a
+//  time through a small buffer, output goes a sector at a time through
+//  sector_data, so the block and line caches must be flushed first.
+//  Export reads the header and story through the spare block buffers and
+//  keeps the frame chain in the line cache. Import can't: the stack it
+//  rebuilds goes through the caches, so only its header check uses one.
+
+uint8_t sector_write(uint16_t sector, uint8_t* data);   // zorkduino.ino
+extern uint8_t cache_data[128];    // zdIO.cpp
+
+#define Q_CHUNK   64
+
+PROGMEM const char q_ids[] = "FORMIFZSIFhdCMemStksUMem";
+#define Q_FORM    0
+#define Q_IFZS    1
+#define Q_IFHD    2
+#define Q_CMEM    3
+#define Q_STKS    4
+#define Q_UMEM    5
+
+#define Q_CMEM_LENGTH   38    // FORM header, IFhd chunk, CMem id
+
+typedef struct {
+    uint32_t pos;     // bytes written so far
+    uint8_t r;
+} QOut;
+
+typedef struct {
+    uint32_t pos;
+    uint32_t base;    // of the chunk in b
+    uint8_t r;
+    uint8_t b[Q_CHUNK];
+} QIn;
+
+void q_byte(QOut* o, uint8_t b)
+{
+    uint16_t i = o->pos++ & 511;
+    sector_data[i] = b;
+    if (i == 511 && !o->r)
+    {
+        uint16_t s = (o->pos - 1) >> 9;
+        audio_beep(DISKBEEP_FREQ,16);
+        o->r = s < EXPORT_SECTORS ? MMC_WriteSector(sector_data,sector_mem(EXPORT_SECTOR + s)) : 1;
+    }
+}
+
+void q_word(QOut* o, uint16_t w)
+{
+    q_byte(o,w >> 8);
+    q_byte(o,w);
+}
+
+void q_long(QOut* o, uint32_t l)
+{
+    q_word(o,l >> 16);
+    q_word(o,l);
+}
+
+void q_id(QOut* o, uint8_t id)
+{
+    for (uint8_t i = 0; i < 4; i++)
+        q_byte(o,pgm_read_byte(q_ids + id*4 + i));
+}
+
+uint8_t q_in(QIn* in)
+{
+    uint32_t base = in->pos & ~(uint32_t)(Q_CHUNK-1);
+    if (base != in->base)
+    {
+        in->base = base;
+        if ((base >> 9) >= EXPORT_SECTORS)
+            in->r = 1;
+        else if (!in->r)
+            in->r = MMC_ReadSectorPart(in->b,sector_mem(EXPORT_SECTOR + (base >> 9)),base & 511,Q_CHUNK);
+    }
+    return in->b[in->pos++ & (Q_CHUNK-1)];
+}
+
+uint16_t q_in_word(QIn* in)
+{
+    uint16_t w = q_in(in) << 8;
+    return w | q_in(in);
+}
+
+uint32_t q_in_long(QIn* in)
+{
+    uint32_t l = (uint32_t)q_in_word(in) << 16;
+    return l | q_in_word(in);
+}
+
+// Index of a chunk id read from the file, 0xFF if unknown
+uint8_t q_in_id(QIn* in)
+{
+    uint8_t id[4];
+    for (uint8_t i = 0; i < 4; i++)
+        id[i] = q_in(in);
+    for (uint8_t k = 0; k <= Q_UMEM; k++)
+        if (!memcmp_P(id,q_ids + k*4,4))
+            return k;
+    return 0xFF;
+}
+
+// Stack words straight from the card
+zword_t q_stack(zword_t i)
+{
+    zword_t w = 0;
+    MMC_ReadSectorPart((uint8_t*)&w,sector_mem(STACK_SECTOR + (i >> 8)),(i & 0xFF) << 1,2);
+    return w;
+}
+
+// Write frame f (STACK_SIZE-1 being the dummy bottom one) called into c,
+// 0 if f is current, or just count its bytes if o is 0. Nonzero if it
+// can't be expressed, an interrupt routine in progress say.
+uint8_t q_frame(QOut* o, uint16_t* len, zword_t f, zword_t c)
+{
+    zword_t a = f == STACK_SIZE-1 ? 0 : q_stack(f + 1);
+    uint8_t locals = a >> VARS_SHIFT;
+    zword_t eval = f + 1 - locals - (c ? c + 5 : sp);
+    if ((a & TYPE_MASK) == ASYNC)
+        return 1;
+    *len += 8 + 2*(locals + eval);
+    if (!o)
+        return 0;
+    uint32_t ret = 0;
+    uint8_t flags = locals;
+    uint8_t var = 0;
+    if (f != STACK_SIZE-1)
+    {
+        ret = ((uint32_t)q_stack(f + 4) << 9) + q_stack(f + 3);
+        if ((a & TYPE_MASK) == PROCEDURE)
+            flags |= 0x10;
+        else                // JZIP returns to the store byte, Quetzal past it
+        {
+            uint16_t s = ret >> 9;
+            MMC_ReadSectorPart(&var,ret < h_restart_size ? sector_mem(GAME_SECTOR + s) : map_sector(&game_map,s),ret & 511,1);
+            ret++;
+        }
+    }
+    q_byte(o,ret >> 16);
+    q_word(o,ret);
+    q_byte(o,flags);
+    q_byte(o,var);
+    q_byte(o,(1 << (a & ARGS_MASK)) - 1);
+    q_word(o,eval);
+    for (zword_t i = 0; i < locals + eval; i++)
+        q_word(o,q_stack(f - i));
+    return 0;
+}
+
+// Write the Stks frames oldest first, or just count their bytes if o is 0.
+// The chain runs down from fp, so one walk collects the frame pointers in
+// the (flushed) line cache; deeper than that takes a walk per batch.
+#define Q_FRAMES  (sizeof(cache_data)/sizeof(zword_t))
+
+uint8_t q_frames(QOut* o, uint16_t* len)
+{
+    zword_t* chain = (zword_t*)cache_data;
+    zword_t f = STACK_SIZE-1;
+    *len = 0;
+    for (;;)
+    {
+        uint16_t k = 0;     // frames called from f, the oldest Q_FRAMES kept
+        for (zword_t x = fp; x != f && x < STACK_SIZE-1; x = q_stack(x + 2))
+            chain[k++ % Q_FRAMES] = x;
+        uint16_t n = k < Q_FRAMES ? k : Q_FRAMES;
+        for (uint16_t j = 0; j < n; j++)
+        {
+            zword_t c = chain[(k - 1 - j) % Q_FRAMES];
+            if (q_frame(o,len,f,c))
+                return 1;
+            f = c;
+        }
+        if (k <= Q_FRAMES)
+            return q_frame(o,len,f,0);
+    }
+}
+
+// Export the running game, nonzero on failure
+uint8_t quetzal_export()
+{
+    QOut o = {0,0};
+    uint8_t* h = block_buffer(2);
+    uint8_t* b = block_buffer(1);
+    uint16_t stks;
+    if (MMC_ReadSectorPart(h,sector_mem(GAME_SECTOR),0,H_CHECKSUM+2) || q_frames(0,&stks))
+        return 1;
+
+    q_id(&o,Q_FORM);
+    q_long(&o,0);                           // patched below
+    q_id(&o,Q_IFZS);
+    q_id(&o,Q_IFHD);
+    q_long(&o,13);
+    q_byte(&o,h[H_VERSION]);                // release
+    q_byte(&o,h[H_VERSION+1]);
+    for (uint8_t i = 0; i < 6; i++)
+        q_byte(&o,h[H_RELEASE_DATE+i]);     // serial
+    q_byte(&o,h[H_CHECKSUM]);
+    q_byte(&o,h[H_CHECKSUM+1]);
+    q_byte(&o,pc >> 16);
+    q_word(&o,pc);
+    q_byte(&o,0);                           // pad
+
+    // Runs of zeros in dynamic memory XOR story are a zero and a count
+    q_id(&o,Q_CMEM);
+    q_long(&o,0);
+    uint16_t zeros = 0;
+    for (uint16_t s = 0; ((uint32_t)s << 9) < h_restart_size && !o.r; s++)
+    {
+        uint16_t n = h_restart_size - ((uint32_t)s << 9) < 512 ? h_restart_size - ((uint32_t)s << 9) : 512;
+        if ((o.r = MMC_ReadSectorPart(b,map_sector(&game_map,s),0,n)) ||
+            (o.r = MMC_XorSectorPart(b,sector_mem(GAME_SECTOR + s),0,n)))
+            break;
+        for (uint16_t i = 0; i < n; i++)
+        {
+            if (b[i] == 0) {
+                zeros++;
+                continue;
+            }
+            while (zeros)
+            {
+                uint16_t k = zeros > 256 ? 256 : zeros;
+                q_byte(&o,0);
+                q_byte(&o,k - 1);
+                zeros -= k;
+            }
+            q_byte(&o,b[i]);
+        }
+    }
+    uint32_t cmem = o.pos - (Q_CMEM_LENGTH + 4);
+    if (o.pos & 1)
+        q_byte(&o,0);
+
+    q_id(&o,Q_STKS);
+    q_long(&o,stks);
+    if (o.r || q_frames(&o,&stks))
+        return 1;
+
+    // Flush the last sector, then fill in the lengths
+    uint32_t form = o.pos - 8;
+    while (o.pos & 511)
+        q_byte(&o,0);
+    if (o.r || MMC_ReadSector(sector_data,sector_mem(EXPORT_SECTOR)))
+        return 1;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        sector_data[4 + i] = form >> (24 - 8*i);
+        sector_data[Q_CMEM_LENGTH + i] = cmem >> (24 - 8*i);
+    }
+    return MMC_WriteSector(sector_data,sector_mem(EXPORT_SECTOR));
+}
+
+// Import the file in the export area: 0 ok, 1 failed, 2 for another game
+uint8_t quetzal_import()
+{
+    QIn in;
+    in.pos = 0;
+    in.base = 0xFFFFFFFF;
+    in.r = 0;
+    uint8_t* h = block_buffer(2);
+    uint32_t ret = 0, mem = 0, mem_end = 0, stks = 0, stks_end = 0, end;
+    uint8_t umem = 0;
+
+    if (q_in_id(&in) != Q_FORM)
+        return 1;
+    end = q_in_long(&in) + 8;
+    if (q_in_id(&in) != Q_IFZS || end > EXPORT_SECTORS*512L)
+        return 1;
+    while (in.pos < end && !in.r)
+    {
+        uint8_t id = q_in_id(&in);
+        uint32_t len = q_in_long(&in);
+        uint32_t next = in.pos + len + (len & 1);
+        if (id == Q_IFHD)
+        {
+            if (MMC_ReadSectorPart(h,sector_mem(GAME_SECTOR),0,H_CHECKSUM+2))
+                return 1;
+            uint8_t same = q_in(&in) == h[H_VERSION];
+            same &= q_in(&in) == h[H_VERSION+1];
+            for (uint8_t i = 0; i < 6; i++)
+                same &= q_in(&in) == h[H_RELEASE_DATE+i];
+            same &= q_in(&in) == h[H_CHECKSUM];
+            same &= q_in(&in) == h[H_CHECKSUM+1];
+            if (!same)
+                return 2;
+            ret = (uint32_t)q_in(&in) << 16;
+            ret |= q_in_word(&in);
+        }
+        else if (id == Q_CMEM || id == Q_UMEM)
+        {
+            mem = in.pos;
+            mem_end = in.pos + len;
+            umem = id == Q_UMEM;
+        }
+        else if (id == Q_STKS)
+        {
+            stks = in.pos;
+            stks_end = in.pos + len;
+        }
+        in.pos = next;
+    }
+    if (in.r || !ret || !mem || !stks || mem_end > end || stks_end > end)
+        return 1;
+
+    // Check it all before touching the running game. Memory can't expand past
+    // dynamic memory, the frames have to fill Stks exactly and fit the stack
+    uint32_t n = 0;
+    in.pos = mem;
+    while (in.pos < mem_end && !in.r)
+    {
+        uint8_t x = q_in(&in);
+        n += umem || x ? 1 : q_in(&in) + 1;
+    }
+    if (in.r || in.pos != mem_end || n > h_restart_size)
+        return 1;
+    n = 0;
+    in.pos = stks;
+    while (in.pos < stks_end && !in.r)
+    {
+        in.pos += 3;
+        uint8_t locals = q_in(&in) & 0x0F;
+        in.pos += 2;
+        zword_t eval = q_in_word(&in);
+        n += (in.pos > stks + 8 ? 4 : 0) + locals + eval;
+        in.pos += 2*(locals + eval);
+    }
+    if (in.r || in.pos != stks_end || n > STACK_SIZE - 20)
+        return 1;           // save() keeps its info at the bottom
+
+    // Rebuild dynamic memory a sector at a time from the story, writing what changed
+    uint16_t zeros = 0;
+    in.pos = mem;
+    for (uint16_t s = 0; s < (h_restart_size + 511) >> 9; s++)
+    {
+        uint8_t same;
+        if (MMC_ReadSector(sector_data,map_sector(&game_map,s)))
+            return 1;
+        for (uint16_t i = 0; i < 512 && ((uint32_t)s << 9) + i < h_restart_size; i++)
+        {
+            if (zeros)
+                zeros--;
+            else if (in.pos >= mem_end)
+                break;
+            else if (umem)
+                sector_data[i] = q_in(&in);
+            else
+            {
+                uint8_t x = q_in(&in);
+                if (x)
+                    sector_data[i] ^= x;
+                else
+                    zeros = q_in(&in);
+            }
+        }
+        if (in.r || MMC_CompareSector(sector_data,sector_mem(GAME_SECTOR + s),&same) ||
+            (!same && sector_write(GAME_SECTOR + s,sector_data)))
+            return 1;
+    }
+
+    // Then the stack, oldest frame first. The first is the dummy one
+    // holding just the evaluation stack.
+    in.pos = stks;
+    sp = STACK_SIZE;
+    fp = STACK_SIZE - 1;
+    while (in.pos < stks_end && !in.r)
+    {
+        uint32_t r = (uint32_t)q_in(&in) << 16;
+        r |= q_in_word(&in);
+        uint8_t flags = q_in(&in);
+        q_in(&in);              // result variable, the story has it at the store byte
+        uint8_t args = q_in(&in);
+        zword_t eval = q_in_word(&in);
+        uint8_t locals = flags & 0x0F;
+        if (in.pos > stks + 8)
+        {
+            zword_t argc = 0;
+            while (args & (1 << argc))
+                argc++;
+            if (!(flags & 0x10))
+                r--;
+            PUSH(r / PAGE_SIZE);
+            PUSH(r % PAGE_SIZE);
+            PUSH(fp);
+            PUSH(argc | ((flags & 0x10) ? PROCEDURE : FUNCTION) | (locals << VARS_SHIFT));
+            fp = sp - 1;
+        }
+        for (zword_t i = 0; i < locals + eval; i++)
+            PUSH(q_in_word(&in));
+    }
+    if (in.r)
+        return 1;
+    pc = ret;
+    return 0;
+}
+#endif
@@ -16,6 +16,8 @@
 */
 
 #include "Arduino.h"
+#include "ztypes.h"
+#include "zdMmc.h"
 #include "zdThin.h"
 
 extern uint8_t sector_data[512];
@@ -33,6 +35,12 @@ static u32 GET32(const u8* p)
     return *((u32*)p);
 }
 
+static bool FirstRun(u32, u32 count, void* ref)
+{
+    *((u16*)ref) = count;
+    return true;
+}
+
 u8 Fat::Init()
 {
     u8* buf = _buffer;
@@ -87,13 +95,7 @@ u8 Fat::Init()
 
     //  Calculate root count for FAT32 
     if (rootCluster)
-    {
-        Extent extents[1];
-        extents[0].start = 2;
-        extents[0].count = 1;
-        LoadExtents(extents,1);
-        rootCount = extents[0].count * sectorsPerCluster; // # of sectors in first cluster of root
-    }
+        Runs(rootCluster,FirstRun,&rootCount);  // # of sectors in first run of root
     return rootCluster ? FAT_32 : FAT_16;
 }
 
@@ -106,9 +108,8 @@ int Fat::Directory(DirectoryProc directoryProc, void* ref)
         if (readSector(_buffer, rootStart + i))
             return -1;  // Dir read failed
 
-        u8 d = 16;
         DirectoryEntry* entry = (DirectoryEntry*)_buffer;
-        while (d--)
+        for (u8 d = 0; d < 16; d++, entry++)
         {
             if (entry->fatname[0] == 0)
                 return -1;
@@ -117,11 +118,11 @@ int Fat::Directory(DirectoryProc directoryProc, void* ref)
             {
                 //  deleted, dir, volume label etc
             } else {
-                //  file
-                if (directoryProc(entry,i,ref))
-                    return i;
+                //  file, index is the entry number
+                int index = (i << 4) | d;
+                if (directoryProc(entry,index,ref))
+                    return index;
             }
-            entry++;
         }
     }
     return -1;
@@ -157,32 +158,45 @@ u32 Fat::NextCluster(u32* s, u32 currentCluster)
     return ((u16*)_buffer)[currentCluster & 0xFF];
 }
 
-//  File is bigger than a single cluster
-//  Load first 3 extents
-//  Bad news: Opening a very large file takes a long time
-//  Good news: unless file is badly fragmented, subsequent acceses will be much faster
-void Fat::LoadExtents(Extent* extents, int maxExtents)
+u32 Fat::Sector(u32 cluster)
+{
+    return clusterStart + (cluster - 2)*sectorsPerCluster;
+}
+
+u32 Fat::Cluster(const DirectoryEntry* entry)
 {
-    u8 i = 0;
+    u32 cluster = entry->clusterH;
+    return (cluster << 16) | entry->clusterL;
+}
+
+//  Walk a cluster chain as runs of contiguous sectors. NextCluster only
+//  reads a FAT sector when the chain leaves the one it has, so a file
+//  costs about one read per 128 (FAT32) or 256 (FAT16) clusters.
+//  runProc must leave sector_data alone, it holds the current FAT sector.
+void Fat::Runs(u32 cluster, RunProc runProc, void* ref)
+{
+    u32 last = rootCluster ? 0x0FFFFFF8 : 0xFFF8;
     u32 state = 0;
-    u32 current = extents[0].start;
+    u32 start = cluster;
+    u32 count = 1;
     for (;;)
     {
-        u32 next = NextCluster(&state,current);
-        if (next != current + 1)
+        u32 next = NextCluster(&state,cluster);
+        if (rootCluster)
+            next &= 0x0FFFFFFF;
+        if (next == cluster + 1)
         {
-            if (i == maxExtents-1)
-                break;
-            if (next == (rootCluster ? 0x0FFFFFFF : 0xFFFF))
-                break;
-            extents[++i].start = next;
-            extents[i].count = 0;
+            count++;
+            cluster = next;
+            continue;
         }
-        extents[i].count++;
-        current = next;
+        if (runProc(Sector(start),count*sectorsPerCluster,ref))
+            return;
+        if (next < 2 || next >= last)
+            return;     // end of chain, or free/bad cluster
+        start = cluster = next;
+        count = 1;
     }
-    while (i < maxExtents-1)
-        extents[++i].start = 0;
 }
 
 #define UPPER(_x) ((_x >= 'a' && _x <= 'z') ? (_x + 'A' - 'a') : _x)
@@ -224,52 +238,252 @@ bool Fat::Find(const char* path, DirectoryEntry* entry)
     return index != -1;
 }
 
-//  Load extents when file is open. TODO: short check for very large files
-bool Fat::Open(const char* path, ExtentInfo* extent)
+//  Reread an entry by the index Directory passed for it, one sector
+bool Fat::Entry(int index, DirectoryEntry* entry)
 {
-    DirectoryEntry entry;
-
-    if (!Find(path,&entry))
+    if (readSector(_buffer, rootStart + (index >> 4)))
         return false;
-
-    extent->fileLength = entry.length;
-    u32 cluster = entry.clusterH;
-    extent->extents[0].start = (cluster << 16) | entry.clusterL;
-    extent->extents[0].count = 1;
-    extent->extents[1].start = 0;
-    if (extent->fileLength > (sectorsPerCluster<<9))
-        LoadExtents(extent->extents,3);
+    *entry = ((DirectoryEntry*)_buffer)[index & 15];
     return true;
 }
 
-//  TODO: read beyond 3 extent!
-//  TODO: Store extents as absolute sectors rather than clusters, avoid muls
+//  First sector and length of a file, enough for one read from the start
+bool Fat::Open(const char* path, uint32_t* startSector, uint32_t* fileLength)
+{
+  DirectoryEntry entry;
+  if (!Find(path,&entry))
+    return false;
+  *fileLength = entry.length;
+  *startSector = Sector(Cluster(&entry));
+  return true;
+}
+
+//  File maps. zd.mem and the story file may be fragmented, each is a list of
+//  runs of contiguous sectors. The whole list is kept in zd.mem's meta sectors
+//  so later boots skip the FAT walk, the first few runs and the last one
+//  looked up stay in RAM. Without BIG_RAM only the last one is kept, and the
+//  story's map sectors are found through zd.mem's map rather than held.
+//  Without FILE_MAPS a file is just where its first cluster is.
+
+FileMap mem_map;
+FileMap game_map;
+
+#if FILE_MAPS
+
+#define MAP_MAGIC           0x504D  // "MP"
+#define MAP_RUNS_PER_SECTOR 12
+#define MAP_RUN_OFFSET      16
+
+typedef struct {
+    uint16_t magic;
+    uint16_t runs;
+    uint32_t cluster;   // first cluster and length, a rewritten file won't match
+    uint32_t length;
+    uint32_t filler;
+} MapHeader;
+
+#if !MAP_RAM_RUNS
+static uint32_t mem_map_at[MAP_SECTORS];
+#endif
+
+// Where map sector k of a file is
+static uint32_t map_at(FileMap* m, uint8_t k)
+{
+#if MAP_RAM_RUNS
+    return m->map[k];
+#else
+    if (m->file == 0)
+        return mem_map_at[k];
+    return map_sector(&mem_map,MAP_SECTOR(m->file) + k);
+#endif
+}
+
+static uint8_t map_record(FileMap* m, uint16_t i, Run* r)
+{
+    return MMC_ReadSectorPart((uint8_t*)r,map_at(m,i/MAP_RUNS_PER_SECTOR),MAP_RUN_OFFSET + (i % MAP_RUNS_PER_SECTOR)*sizeof(Run),sizeof(Run));
+}
 
-bool Fat::FindSector(u32* sector, ExtentInfo* extent)
+static inline bool run_has(Run* r, uint16_t s)
 {
-    u8 i = 0;
-    while (i < 3)
+    return (uint16_t)(s - r->base) < r->count;
+}
+
+// Runs are in file order, binary search the ones on the card
+static void map_find(FileMap* m, uint16_t s)
+{
+    uint16_t lo = 0;
+    uint16_t hi = m->runs;
+    while (hi - lo > 1)
     {
-        u32 s = extent->extents[i].count*sectorsPerCluster;
-        if (*sector < s)
-        {
-            u32 cluster = extent->extents[i].start;
-            *sector += clusterStart + (cluster - 2)*sectorsPerCluster;
-            return true;
-        }
-        *sector -= s;
-        i++;
+        uint16_t mid = (lo + hi) >> 1;
+        map_record(m,mid,&m->last);
+        if (s < m->last.base)
+            hi = mid;
+        else
+            lo = mid;
     }
-    // TODO: Deal with nasty fragmentation
-    return false;
+    map_record(m,lo,&m->last);
 }
 
-bool Fat::Open(const char* path, uint32_t* startSector, uint32_t* fileLength)
+// Absolute sector of sector s of a file, left is how many follow it in its run
+uint32_t map_sector(FileMap* m, uint16_t s, uint16_t* left)
+{
+    Run* r = &m->last;
+#if MAP_RAM_RUNS
+    r = m->run;
+    uint8_t n = m->runs < MAP_RAM_RUNS ? m->runs : MAP_RAM_RUNS;
+    while (n && !run_has(r,s)) {
+        r++;
+        n--;
+    }
+    if (!n)
+        r = &m->last;
+#endif
+    if (r == &m->last && !run_has(r,s))
+        map_find(m,s);
+    if (left)
+        *left = r->base + r->count - s;
+    return r->sector + (uint16_t)(s - r->base);
+}
+
+// Where the map sectors of zd.mem are, before its map is known
+typedef struct {
+    uint32_t* map;
+    uint16_t base;
+} MapLocate;
+
+static bool map_locate(u32 sector, u32 count, void* ref)
+{
+    MapLocate* l = (MapLocate*)ref;
+    for (uint8_t k = 0; k < MAP_SECTORS; k++)
+    {
+        uint32_t s = (uint32_t)(MAP_SECTOR(0) + k) - l->base;
+        if (s < count)
+            l->map[k] = sector + s;
+    }
+    l->base += count;
+    return l->base >= MAP_SECTOR(0) + MAP_SECTORS;
+}
+
+// Collects runs a map sector at a time
+typedef struct {
+    MapHeader h;
+    Run run[MAP_RUNS_PER_SECTOR];
+} MapChunk;
+
+typedef struct {
+    FileMap* m;
+    uint16_t base;
+    MapChunk chunk;
+} MapBuild;
+
+static bool map_run(u32 sector, u32 count, void* ref)
 {
-  ExtentInfo extent;
-  if (!Open(path,&extent))
+    MapBuild* b = (MapBuild*)ref;
+    FileMap* m = b->m;
+    uint16_t i = m->runs++;
+    if (i >= MAP_SECTORS*MAP_RUNS_PER_SECTOR)
+        return true;    // too fragmented
+    Run* r = b->chunk.run + i % MAP_RUNS_PER_SECTOR;
+    r->sector = sector;
+    r->base = b->base;
+    r->count = count;
+    b->base += count;
+#if MAP_RAM_RUNS
+    if (i < MAP_RAM_RUNS)
+        m->run[i] = *r;
+#endif
+    if (m->runs % MAP_RUNS_PER_SECTOR == 0)
+    {
+        MMC_WriteSectorPart((uint8_t*)&b->chunk,map_at(m,i/MAP_RUNS_PER_SECTOR),sizeof(MapChunk));
+        memset(b->chunk.run,0,sizeof(b->chunk.run));
+    }
     return false;
-  *fileLength = extent.fileLength;
-  *startSector = 0;
-  return FindSector(startSector,&extent);
 }
+
+// Map file f (see MAP_SECTOR), from its cached map if the file hasn't
+// changed, else by walking the FAT and caching the result
+uint8_t map_open(Fat* fat, FileMap* m, const DirectoryEntry* e, uint8_t f)
+{
+    uint32_t cluster = Fat::Cluster(e);
+    memset(m,0,sizeof(FileMap));
+#if MAP_RAM_RUNS
+    uint8_t k;
+    if (f == 0) {
+        MapLocate l = {m->map,0};
+        fat->Runs(cluster,map_locate,&l);
+    } else {
+        for (k = 0; k < MAP_SECTORS; k++)
+            m->map[k] = map_sector(&mem_map,MAP_SECTOR(f) + k);
+    }
+#else
+    m->file = f;
+    if (f == 0) {
+        MapLocate l = {mem_map_at,0};
+        fat->Runs(cluster,map_locate,&l);
+    }
+#endif
+
+    MapBuild b;
+    MapHeader* h = &b.chunk.h;
+    if (MMC_ReadSectorPart((uint8_t*)h,map_at(m,0),0,sizeof(MapHeader)))
+        return 1;
+    if (h->magic == MAP_MAGIC && h->cluster == cluster && h->length == e->length)
+    {
+        m->runs = h->runs;
+#if MAP_RAM_RUNS
+        for (k = 0; k < MAP_RAM_RUNS && k < m->runs; k++)
+            if (map_record(m,k,m->run + k))
+                return 1;
+#endif
+        return 0;
+    }
+
+    memset(&b,0,sizeof(b));     // sector 0 stays invalid until the end
+    b.m = m;
+    fat->Runs(cluster,map_run,&b);
+    if (m->runs > MAP_SECTORS*MAP_RUNS_PER_SECTOR)
+        return 2;
+    if (m->runs % MAP_RUNS_PER_SECTOR)
+        MMC_WriteSectorPart((uint8_t*)&b.chunk,map_at(m,(m->runs-1)/MAP_RUNS_PER_SECTOR),sizeof(MapChunk));
+    if (m->runs >= MAP_RUNS_PER_SECTOR && MMC_ReadSectorPart((uint8_t*)&b.chunk,map_at(m,0),0,sizeof(MapChunk)))
+        return 1;
+    h->magic = MAP_MAGIC;
+    h->runs = m->runs;
+    h->cluster = cluster;
+    h->length = e->length;
+    return MMC_WriteSectorPart((uint8_t*)&b.chunk,map_at(m,0),sizeof(MapChunk));
+}
+
+// Copy n sectors between mapped files, split wherever either run ends
+uint8_t map_copy(FileMap* dm, uint16_t dst, FileMap* sm, uint16_t src, uint16_t n)
+{
+    while (n)
+    {
+        uint16_t a,b;
+        uint32_t d = map_sector(dm,dst,&a);
+        uint32_t s = map_sector(sm,src,&b);
+        uint16_t k = min(n,min(a,b));
+        uint8_t r = copy_sectors(d,s,k);
+        if (r)
+            return r;
+        dst += k;
+        src += k;
+        n -= k;
+    }
+    return 0;
+}
+
+#else
+
+// The first run has to hold the whole file
+uint8_t map_open(Fat* fat, FileMap* m, const DirectoryEntry* e, uint8_t)
+{
+    u16 count = 0;
+    u32 cluster = Fat::Cluster(e);
+    m->sector = fat->Sector(cluster);
+    fat->Runs(cluster,FirstRun,&count);
+    return count < (e->length + 511) >> 9 ? 2 : 0;
+}
+
+#endif
@@ -30,18 +30,6 @@ typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned long u32;
 
-typedef struct
-{
-  u32 start;
-  u32 count;
-} Extent;
-
-typedef struct
-{
-  u32 fileLength;
-  Extent extents[3];    // First 3 extents
-} ExtentInfo;
-
 typedef struct
 {
    char fatname[11];
@@ -56,6 +44,7 @@ typedef struct
 
 typedef u8 (*ReadProc)(u8* buffer, u32 sector);
 typedef bool (*DirectoryProc)(DirectoryEntry* d, int index, void* ref);
+typedef bool (*RunProc)(u32 sector, u32 count, void* ref);  // true to stop
 
 class Fat
 {
@@ -63,13 +52,15 @@ class Fat
   uint8_t    Init();
   bool  Open(const char* path, uint32_t* startSector, uint32_t* fileLength);
   int   Directory(DirectoryProc directoryProc, void* ref);
+  bool  Entry(int index, DirectoryEntry* entry);
+  bool  Find(const char* path, DirectoryEntry* entry);
+  void  Runs(u32 cluster, RunProc runProc, void* ref);
+  u32   Sector(u32 cluster);
+
+  static u32 Cluster(const DirectoryEntry* entry);
 
 protected:
-  bool Find(const char* path, DirectoryEntry* entry);
-  bool Open(const char* path, ExtentInfo* extent);
-  bool FindSector(u32* sector, ExtentInfo* extent);
   u32 NextCluster(u32* s, u32 currentCluster);
-  void LoadExtents(Extent* extents, int maxExtents);
 
   uint32_t rootStart;
   uint16_t rootCount;
@@ -80,4 +71,54 @@ protected:
   uint32_t rootCluster;
 };
 
+//  File maps, see zdThin.cpp. Needs ztypes.h for the zd.mem layout
+#if FILE_MAPS
+
+#if BIG_RAM
+#define MAP_RAM_RUNS 8
+#else
+#define MAP_RAM_RUNS 0
+#endif
+
+typedef struct {
+    uint32_t sector;    // absolute
+    uint16_t base;      // sector in the file it starts at
+    uint16_t count;
+} Run;
+
+typedef struct {
+    uint16_t runs;
+#if MAP_RAM_RUNS
+    uint32_t map[MAP_SECTORS];    // where the map sectors are
+    Run run[MAP_RAM_RUNS];
+#else
+    uint8_t file;                 // see MAP_SECTOR
+#endif
+    Run last;
+} FileMap;
+
+uint32_t map_sector(FileMap* m, uint16_t s, uint16_t* left = 0);
+uint8_t map_copy(FileMap* dm, uint16_t dst, FileMap* sm, uint16_t src, uint16_t n);
+
+#else
+
+typedef struct {
+    uint32_t sector;    // absolute sector of the file's first
+} FileMap;
+
+inline uint32_t map_sector(FileMap* m, uint16_t s)
+{
+    return m->sector + s;
+}
+
+#define map_copy(_dm,_dst,_sm,_src,_n) copy_sectors(map_sector(_dm,_dst),map_sector(_sm,_src),_n)
+
+#endif
+
+extern FileMap mem_map;     // zd.mem
+extern FileMap game_map;    // story file
+
+uint8_t map_open(Fat* fat, FileMap* m, const DirectoryEntry* e, uint8_t f);
+uint8_t copy_sectors(uint32_t dst, uint32_t src, uint16_t n);
+
 #endif // __THIN_H__
@@ -17,6 +17,7 @@
 // Video output, audio tone generation and IR keyboard scanning events
 
 #include "ztypes.h"
+#include "zdMmc.h"
 
 __attribute__((section(".progmem.data")))
 const unsigned char atascii[] = {
@@ -171,11 +172,19 @@ ISR(TIMER1_OVF_vect)
     if (v_state == STATE_ACTIVE)
     {
       disable_ps2();         // don't field ps2 keyboard interrupts during active video
+#if MMC_ASYNC
+      MMC_AsyncHold(1);      // nor SD bytes
+#endif
       if (v_vbicountdown)
           v_vbicountdown--;  // VBI countdown timer
     }
     else if (v_state == STATE_POST)
+    {
         enable_ps2();
+#if MMC_ASYNC
+        MMC_AsyncHold(0);
+#endif
+    }
   }
 
   // ir keyboard
@@ -52,24 +52,51 @@
 #include "zdMmc.h"
 #include "zdThin.h"
 
-//================================================================================
-//================================================================================
-//  Audio feedback for keyboard and io
-
-#define HSYNC_FREQ (1000000/63.555)
-#define KEYBEEP_FREQ (HSYNC_FREQ/1000)
-#define DISKBEEP_FREQ (HSYNC_FREQ/3600)
-
 // zdVideo.cpp
-void audio_beep(uint8_t freq, uint8_t cycles);
 void start_video(); 
 uint8_t readKey();
 
+// zdIO.cpp
+extern uint8_t cache_data[128];
+uint8_t* block_buffer(uint8_t i);
+
 //================================================================================
 //================================================================================
 
 uint8_t sector_data[512];
-uint32_t sector_mem_start;
+uint16_t sector_slot;           // stack and dynamic memory of the current game
+uint8_t game_slot;
+
+//================================================================================
+//================================================================================
+
+// Only dynamic memory is copied into zd.mem, static and high memory
+// sectors [sector_lazy_lo,sector_lazy_hi) are read in place from the story file
+uint16_t sector_lazy_lo = 0xFFFF;
+uint16_t sector_lazy_hi;
+
+// zd.mem sector of a pagefile sector, stack and dynamic memory are per slot
+inline uint16_t sector_page(uint16_t sector)
+{
+  return sector < CATALOG_SECTOR ? sector + sector_slot : sector;
+}
+
+uint32_t sector_mem(uint16_t sector)
+{
+  return map_sector(&mem_map,sector_page(sector));
+}
+
+uint32_t sector_abs(uint16_t sector)
+{
+  if (sector >= sector_lazy_lo && sector < sector_lazy_hi)
+    return map_sector(&game_map,sector - GAME_SECTOR);
+#if JOURNAL
+  uint16_t j = journal_sector(sector);
+  if (j)
+    return sector_mem(j);
+#endif
+  return sector_mem(sector);
+}
 
 // track the extnet of the stack at sector IO
 // this gives a rough estimate of stack mem
@@ -102,17 +129,225 @@ void STACK_DUMP()
 #define STACK_DUMP()
 #endif
 
-uint8_t sector_write(uint16_t sector)
+//================================================================================
+//================================================================================
+//  Catalog of resident games, first sectors of the meta region
+
+uint8_t session_state = SESSION_NONE;
+bool session_resume = false;
+
+uint8_t catalog_read(uint8_t slot, pageheader_t* h)
+{
+  return MMC_ReadSectorPart((uint8_t*)h,sector_mem(CATALOG_SECTOR+slot),0,sizeof(pageheader_t));
+}
+
+uint8_t catalog_write(uint8_t slot, pageheader_t* h)
+{
+  return MMC_WriteSectorPart((uint8_t*)h,sector_mem(CATALOG_SECTOR+slot),sizeof(pageheader_t));
+}
+
+// Entry of the running game
+uint8_t pagefile_read(pageheader_t* h)
+{
+  return catalog_read(game_slot,h);
+}
+
+uint8_t pagefile_write(pageheader_t* h)
+{
+  session_state = h->state;
+#if JOURNAL
+  journal_used = h->used;
+  journal_epoch = h->journal;
+#endif
+  return catalog_write(game_slot,h);
+}
+
+// Find the slot holding a story, or failing that the one to load it into:
+// an empty slot if there is one, otherwise the one picked longest ago.
+// h is the entry, zeroed if the story isn't resident. used is the newest pick.
+uint8_t catalog_find(pageheader_t* h, const char* name, zword_t release, zword_t checksum, zword_t* used)
+{
+  uint8_t slot = GAME_SLOTS;
+  uint8_t victim = 0;
+  zword_t oldest = 0xFFFF;
+  *used = 0;
+  for (uint8_t i = 0; i < GAME_SLOTS; i++)
+  {
+    if (catalog_read(i,h))
+      return GAME_SLOTS;
+    if (h->magic != PAGEFILE_MAGIC)
+      h->used = 0;
+    else if (h->release == release && h->checksum == checksum && !strcmp(h->name,name))
+      slot = i;
+    if (h->used > *used)
+      *used = h->used;
+    if (h->used < oldest) {
+      oldest = h->used;
+      victim = i;
+    }
+  }
+  if (slot < GAME_SLOTS)
+    return catalog_read(slot,h) ? GAME_SLOTS : slot;
+  memset(h,0,sizeof(pageheader_t));
+  return victim;
+}
+
+// Dynamic memory sectors written since the story was loaded, kept in the
+// slot's WRITTEN_SECTOR too so restart only has to reload those. 2k parts
+// don't track these, or those written since a save (see page_written):
+// restart reloads all of dynamic memory and a save reads every sector.
+
+#if WRITE_TRACKING
+uint8_t written[(DYNAMIC_MAX >> 9) / 8];
+
+uint8_t written_load()
+{
+  return MMC_ReadSectorPart(written,sector_mem(WRITTEN_SECTOR(game_slot)),0,sizeof(written));
+}
+
+uint8_t written_save()
+{
+  return MMC_WriteSectorPart(written,sector_mem(WRITTEN_SECTOR(game_slot)),sizeof(written));
+}
+
+inline bool written_has(uint16_t s)
+{
+  return written[s >> 3] & (1 << (s & 7));
+}
+
+// Recorded before the write lands
+void written_mark(uint16_t sector)
+{
+  uint16_t s = sector - GAME_SECTOR;
+  if (sector < GAME_SECTOR || s >= (DYNAMIC_MAX >> 9) || written_has(s))
+    return;
+  written[s >> 3] |= 1 << (s & 7);
+  written_save();
+}
+
+void written_clear()
+{
+  memset(written,0,sizeof(written));
+}
+#else
+inline uint8_t written_load() { return 0; }
+inline uint8_t written_save() { return 0; }
+inline bool written_has(uint16_t) { return true; }
+inline void written_clear() {}
+#endif
+
+// About to write the stack or dynamic memory
+void session_dirty(uint16_t sector)
+{
+  written_mark(sector);
+  if (session_state != SESSION_CLEAN || sector >= CATALOG_SECTOR)
+    return;
+  pageheader_t h;
+  pagefile_read(&h);
+  h.state = SESSION_DIRTY;
+  pagefile_write(&h);
+}
+
+// Called after restart(), picks up at the read the last session stopped in
+void session_restore()
+{
+  if (!session_resume)
+    return;
+  session_resume = false;
+  pageheader_t h;
+  pagefile_read(&h);
+  pc = h.pc;
+  sp = h.sp;
+  fp = h.fp;
+}
+
+//================================================================================
+//================================================================================
+//  Restart. Only the dynamic memory sectors written since the story was
+//  loaded are copied from it again, all of them on 2k parts.
+
+void cache_flush_all();   // zdIO.cpp
+
+uint8_t written_reload()
+{
+  uint8_t r = 0;
+  uint16_t i = 0;
+  uint16_t n = sector_lazy_lo - GAME_SECTOR;
+  bool any = false;
+  while (i < n && !r)
+  {
+    uint16_t k = 0;
+    while (i + k < n && written_has(i + k))
+      k++;
+    if (k) {
+      session_dirty(GAME_SECTOR + i);
+      r = map_copy(&mem_map,sector_page(GAME_SECTOR + i),&game_map,i,k);
+      i += k;
+      any = true;
+    } else
+      i++;
+  }
+  if (any && !r) {
+    page_track(0xFF);     // no longer matches any save
+    written_clear();
+    r = written_save();
+  }
+  return r;
+}
+
+// The restart opcode, not the one at boot that may be resuming a session
+void restart_reload()
+{
+  if (session_resume)
+    return;
+  cache_flush_all();
+  written_reload();
+  pin_load();             // lines, pins and stack window now stale
+}
+
+uint8_t sector_write(uint16_t sector, uint8_t* data = sector_data)
 {
   STACK_CHECK();
   audio_beep(DISKBEEP_FREQ,16);
-  return MMC_WriteSector(sector_data,sector+sector_mem_start);
+  if (!journal_put(sector,data))
+    return 0;
+  session_dirty(sector);
+  page_mark(sector);
+  return MMC_WriteSector(data,sector_mem(sector));
+}
+
+uint8_t sector_read(uint16_t sector, uint8_t* data = sector_data)
+{
+  STACK_CHECK();
+  return MMC_ReadSector(data,sector_abs(sector));
+}
+
+// Start reading a sector in the background, nonzero if that can't be done
+uint8_t sector_read_async(uint16_t sector, uint8_t* data)
+{
+#if MMC_ASYNC
+  return MMC_ReadSectorAsync(data,sector_abs(sector));
+#else
+  (void)sector;
+  (void)data;
+  return 1;
+#endif
+}
+
+uint8_t sector_async_wait()
+{
+#if MMC_ASYNC
+  return MMC_AsyncWait();
+#else
+  return 0;
+#endif
 }
 
-uint8_t sector_read(uint16_t sector)
+// Stream part of a sector straight into a cache line
+uint8_t sector_read_part(uint16_t sector, uint8_t* data, uint16_t offset, uint8_t len)
 {
   STACK_CHECK();
-  return MMC_ReadSector(sector_data,sector+sector_mem_start);
+  return MMC_ReadSectorPart(data,sector_abs(sector),offset,len);
 }
 
 uint8_t readSector(uint8_t* data, uint32_t sector)
@@ -120,15 +355,57 @@ uint8_t readSector(uint8_t* data, uint32_t sector)
   return MMC_ReadSector(data,sector);
 }
 
-extern uint8_t cache_data[128];
+// Copy absolute sectors a batch at a time through every block buffer:
+// one multi-block read then one multi-block write per batch
+uint8_t copy_sectors(uint32_t dst, uint32_t src, uint16_t n)
+{
+  while (n)
+  {
+    uint8_t k = 0;
+    while (k < n && block_buffer(k))
+      k++;
+    uint8_t i, r;
+    audio_beep(DISKBEEP_FREQ,16);
+    if (k == 1) {
+      if ((r = MMC_ReadSector(sector_data,src)) || (r = MMC_WriteSector(sector_data,dst)))
+        return r;
+    } else {
+      if ((r = MMC_ReadStart(src)))
+        return r;
+      for (i = 0; i < k; i++)
+        if ((r = MMC_ReadNext(block_buffer(i))))
+          return r;
+      MMC_ReadStop();
+      if ((r = MMC_WriteStart(dst,k)))
+        return r;
+      for (i = 0; i < k; i++)
+        if ((r = MMC_WriteNext(block_buffer(i))))
+          return r;
+      MMC_WriteStop();
+    }
+    src += k;
+    dst += k;
+    n -= k;
+  }
+  return 0;
+}
+
 
 PROGMEM const char s_zdmem[] = "zd.mem";
+PROGMEM const char s_zdcfg[] = "zd.cfg";
+PROGMEM const char s_game[] = "game";
+PROGMEM const char s_resume[] = "resume";
+PROGMEM const char s_checkpoint[] = "checkpoint";
+PROGMEM const char s_prefetch[] = "prefetch";
+PROGMEM const char s_undo[] = "undo";
 PROGMEM const char s_select_game[] = "Select game to load [0..";
 PROGMEM const char s_duino[] = "      d     u     i     n     o";
 PROGMEM const char s_loading[] = "    loading:";
 PROGMEM const char s_rossum[] = "rossumblog.com";
 PROGMEM const char c_nodisk[] = "Can't find micro/sd card";
 PROGMEM const char c_no_memory[] = "Can't find zd.mem file";
+PROGMEM const char c_continue[] = "Continue last session? [y/n]";
+PROGMEM const char c_fragmented[] = "File too fragmented";
 
 extern
 char* screen(uint8_t x, uint8_t y);
@@ -155,12 +432,17 @@ void draw_logo()
   strcpy_P(screen(0,23),s_rossum);
 }
 
+#define MAX_GAMES 40
+
+// One directory walk lists the games and keeps where each entry is,
+// selecting then rereads just that directory sector
 typedef struct {
   int count;
-  int select;
-  char* name;
+  uint16_t* index;  // directory index of each game listed
 } FindGame;
 
+typedef char index_fits[sizeof(Fat) + MAX_GAMES*sizeof(uint16_t) <= sizeof(cache_data) ? 1 : -1];
+
 char* name_pos(uint8_t n)
 {
     uint8_t x = n & 3;
@@ -168,6 +450,18 @@ char* name_pos(uint8_t n)
     return screen(x*9+1,12+y);
 }
 
+// 8.3 directory name to "NAME.EXT"
+void fat_name(char* s, const char* fatname)
+{
+  uint8_t i;
+  for (i = 0; i < 8 && fatname[i] != ' '; i++)
+    *s++ = fatname[i];
+  *s++ = '.';
+  for (i = 8; i < 11 && fatname[i] != ' '; i++)
+    *s++ = fatname[i];
+  *s++ = 0;
+}
+
 // Display list of available games 
 bool find_games(DirectoryEntry* d, int index, void* ref)
 {
@@ -177,26 +471,14 @@ bool find_games(DirectoryEntry* d, int index, void* ref)
     n = d->fatname[9];
     if (n == '3' || n == '4' || n == '5' || n == '7')  // .z3,.z4,.z5,.z7 etc
     {
-      uint8_t i;
       FindGame* fg  = (FindGame*)ref;
-      if (fg->name && (fg->select == fg->count))
-      {
-        char* s = fg->name;
-        for (i = 0; i < 8 && d->fatname[i] != ' '; i++)
-          *s++ = d->fatname[i];
-        *s++ = '.';
-        for (i = 8; i < 11 && d->fatname[i] != ' '; i++)
-          *s++ = d->fatname[i];
-        *s++ = 0;
+      n = fg->count;
+      if (n >= MAX_GAMES)
         return 1;
-      }
-      
-      n = fg->count++;
-      if (n >= 40)
-        return 0;
+      fg->index[fg->count++] = index;
 
       char* s = name_pos(n);
-      for (i = 0; i < 8; i++)
+      for (uint8_t i = 0; i < 8; i++)
         *s++ = tolower(d->fatname[i]);
     }
   }
@@ -216,42 +498,42 @@ void invert_name(int n)
     d[i] ^= 0x80;
 }
 
-void select_game(Fat* fat, char* name)
+// Index lives in the line cache after the Fat, both are only needed at boot
+bool select_game(Fat* fat, char* name, DirectoryEntry* d)
 {
-  FindGame fg = {0};
+  FindGame fg = {0,(uint16_t*)(fat+1)};
   fat->Directory(find_games,&fg);
-  if (fg.count == 1)
-  {
-    fg.name = name;
-    fat->Directory(find_games,&fg);
-    return;
-  }
-  
+  if (fg.count == 0)
+    return false;
+
   int selected = 0;
-  invert_name(0);
-
-  for (;;) {
-    uint8_t c = input_character(-1);
-    int n = selected;
-    switch (c) {
-      case '\n':
-        fg.count = 0;
-        fg.select = n;
-        fg.name = name;
-        fat->Directory(find_games,&fg);
-        return;
-     case UP_KEY:     n = max(n-4,0);           break;
-     case DOWN_KEY:   n = min(n+4,fg.count-1);  break;
-     case LEFT_KEY:   n = max(n-1,0);           break;
-     case RIGHT_KEY:  n = min(n+1,fg.count-1);  break;
-    }
-    if (n != selected)
-    {
-      invert_name(selected);
-      invert_name(n);
-      selected = n;
+  if (fg.count > 1)
+  {
+    invert_name(0);
+    for (;;) {
+      uint8_t c = input_character(-1);
+      if (c == '\n')
+        break;
+      int n = selected;
+      switch (c) {
+       case UP_KEY:     n = max(n-4,0);           break;
+       case DOWN_KEY:   n = min(n+4,fg.count-1);  break;
+       case LEFT_KEY:   n = max(n-1,0);           break;
+       case RIGHT_KEY:  n = min(n+1,fg.count-1);  break;
+      }
+      if (n != selected)
+      {
+        invert_name(selected);
+        invert_name(n);
+        selected = n;
+      }
     }
   }
+
+  if (!fat->Entry(fg.index[selected],d))
+    return false;
+  fat_name(name,d->fatname);
+  return true;
 }
 
 void message(const char* s)
@@ -259,7 +541,80 @@ void message(const char* s)
   strcpy_P(screen(1,14),s);
 }
 
-// Init game by copying game zd file into zd.mem memory
+//================================================================================
+//================================================================================
+//  Optional zd.cfg, one key=value per line
+//    game=zork1.z3   load this game, no menu
+//    resume=y        continue the last session without asking, n to never
+//    checkpoint=0    no resume points, zd.mem only written on eviction
+//    prefetch=0      no background reads of call targets
+//    undo=0          tell games undo isn't available, as 2k parts always do
+
+extern uint8_t config_prefetch;   // zdIO.cpp
+extern uint8_t config_checkpoint;
+extern uint8_t config_undo;
+uint8_t config_resume = 0;        // ask
+
+// Leaves the game to autoload in name, empty if none
+// Blanks around a key or value don't count
+char* config_trim(char* s)
+{
+  while (*s == ' ' || *s == '\t')
+    s++;
+  char* e = s + strlen(s);
+  while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r'))
+    *--e = 0;
+  return s;
+}
+
+void read_config(Fat* fat, char* name)
+{
+  uint32_t start,len;
+  strcpy_P(name,s_zdcfg);
+  bool found = fat->Open(name,&start,&len) && !MMC_ReadSector(sector_data,start);
+  name[0] = 0;
+  if (!found)
+    return;
+  if (len > 511)
+    len = 511;
+  sector_data[len] = 0;
+
+  char* s = (char*)sector_data;
+  while (*s)
+  {
+    char* key = s;
+    char* value = 0;
+    for (; *s && *s != '\n'; s++)
+    {
+      if (*s == '=' && !value) {
+        *s = 0;
+        value = s + 1;
+      }
+    }
+    if (*s)
+      *s++ = 0;
+    if (!value)
+      continue;
+    key = config_trim(key);
+    value = config_trim(value);
+    if (!*value)
+      continue;
+    if (!strcmp_P(key,s_game)) {
+      strncpy(name,value,13);
+      name[13] = 0;
+    }
+    else if (!strcmp_P(key,s_resume))
+      config_resume = tolower(*value);
+    else if (!strcmp_P(key,s_checkpoint))
+      config_checkpoint = *value != '0';
+    else if (!strcmp_P(key,s_prefetch))
+      config_prefetch = *value != '0';
+    else if (!strcmp_P(key,s_undo))
+      config_undo = *value != '0';
+  }
+}
+
+// Init game by copying dynamic memory of the game file into zd.mem
 int initGame()
 {
   draw_logo();
@@ -275,42 +630,123 @@ int initGame()
     
   // Open the memory file
   char buf[14];
-  uint32_t startSector,fileLength;
+  DirectoryEntry d;
   strcpy_P(buf,s_zdmem);
-  if (!fat->Open(buf,&startSector,&fileLength))
+  if (!fat->Find(buf,&d))
   {
     message(c_no_memory);
     return -3;
   }
-  sector_mem_start = startSector;
-  uint16_t memsectors = (fileLength+511) >> 9;
+  if (d.length < MEMORY_FILE_SIZE)
+    return -5;  // Old zd.mem
+  uint8_t r = map_open(fat,&mem_map,&d,0);
+  if (r)
+  {
+    if (r == 2)
+      message(c_fragmented);
+    return -6;
+  }
     
-  // Select game to load
-  select_game(fat,buf);
+  // Select game to load, unless zd.cfg names one
+  read_config(fat,buf);
+  bool autoload = buf[0] && fat->Find(buf,&d);
+  if (!autoload && !select_game(fat,buf,&d))
+    return -4;
   memset(screen(0,12),0,TEXT_COLS*10);
   
   strcpy_P(screen(0,16),s_loading);  // 20 spaces of progress
+  uint16_t gamesectors = (d.length+511) >> 9;
   
-  if (!fat->Open(buf,&startSector,&fileLength))
-    return -4;
-  uint16_t gamesectors = (fileLength+511) >> 9;
-  
-  if (memsectors < (gamesectors + 4))
-    return -5;  // No room for stack + game
+  if (gamesectors > ((SAVE_REGION_OFFSET - GAME_REGION_OFFSET) >> 9))
+    return -5;  // Game too big for the game region
+
+  // Dynamic memory size from the header, the rest is never written
+  if (MMC_ReadSector(sector_data,fat->Sector(Fat::Cluster(&d))))
+    return -6;
+  uint16_t dynsectors = (((uint16_t)sector_data[H_RESTART_SIZE] << 8 | sector_data[H_RESTART_SIZE+1]) + 511) >> 9;
+  if (dynsectors == 0 || dynsectors > gamesectors)
+    dynsectors = gamesectors;
+
+  // zd.mem may still hold this story from last time
+  pageheader_t h;
+  zword_t used;
+  zword_t release = (sector_data[H_VERSION] << 8) | sector_data[H_VERSION+1];
+  zword_t checksum = (sector_data[H_CHECKSUM] << 8) | sector_data[H_CHECKSUM+1];
+  game_slot = catalog_find(&h,buf,release,checksum,&used);
+  if (game_slot >= GAME_SLOTS)
+    return -6;
+  sector_slot = GAME_SLOT_SECTOR(game_slot);
+
+  r = map_open(fat,&game_map,&d,1+game_slot);
+  if (r)
+  {
+    if (r == 2)
+      message(c_fragmented);
+    return -6;
+  }
+  sector_lazy_lo = GAME_SECTOR + dynsectors;
+  sector_lazy_hi = GAME_SECTOR + gamesectors;
+  if (h.magic == PAGEFILE_MAGIC && h.state == SESSION_CLEAN)
+  {
+    if (written_load() || journal_replay(&h))
+      return -6;
+    h.used = used + 1;                // the journal is spent either way
+    if (pagefile_write(&h))
+      return -6;
+    uint8_t c = config_resume;
+    if (h.pc && !c) {
+      message(c_continue);
+      c = input_character(-1);
+      memset(screen(0,14),0,TEXT_COLS);
+    }
+    if (h.pc && (c == 'y' || c == 'Y' || c == '\n'))
+    {
+      session_resume = true;
+      return 0;
+    }
+
+    // Starting over, only what was written needs reloading
+    h.pc = 0;
+    if (written_reload() || pagefile_write(&h))
+      return -6;
+    return 0;
+  }
+
+  // Invalidate while loading
+  memset(&h,0,sizeof(h));
+  h.magic = PAGEFILE_MAGIC;
+  strcpy(h.name,buf);
+  h.release = release;
+  h.checksum = checksum;
+  h.used = used + 1;
+  h.state = SESSION_DIRTY;
+  if (pagefile_write(&h))
+    return -6;
     
   //  Clear stack
   memset(sector_data,0,sizeof(sector_data));
   uint16_t i;
-  for (i = 0; i < 4; i++)
-    sector_write(i);
+  for (i = 0; i < GAME_SECTOR; i++)
+    if (MMC_WriteSector(sector_data,sector_mem(i)))
+      return -6;
     
   char* progress = screen(12,16);
-  for (i = 0; i < gamesectors; i++) {
-    readSector(sector_data,i+startSector);
-    progress[i*20/gamesectors] = 0x80;
-    sector_write(i+4);
+  for (i = 0; i < dynsectors; i += 8) {
+    uint16_t n = dynsectors - i;
+    if (n > 8)
+      n = 8;
+    if (map_copy(&mem_map,sector_slot+GAME_SECTOR+i,&game_map,i,n))
+      return -6;
+    for (uint16_t j = i*20/dynsectors; j <= (i+n-1)*20/dynsectors; j++)
+      progress[j] = 0x80;
   }
-  readKey();
+
+  h.state = SESSION_CLEAN;   // fresh image, nothing to resume
+  written_clear();
+  if (written_save() || pagefile_write(&h))
+    return -6;
+  if (!autoload)
+    readKey();
   return 0;
 }
 
@@ -333,6 +769,8 @@ void invert_screen(bool inLogo = false)
   }
 }
 
+#define CHECKPOINT_IDLE 20    // tenths of a second without a key before a 2k checkpoint
+
 int input_character(int timeout)
 {
   uint8_t c;
@@ -340,8 +778,14 @@ int input_character(int timeout)
   uint16_t start = millis()/100;
   while(!(c = readKey()))
   {
+    MMC_Busy();   // let a pending write finish programming while we wait
+
     // Timeout for borderzone?
     uint16_t elapsed = millis()/100 - start;
+#if !JOURNAL
+    if (elapsed >= CHECKPOINT_IDLE)
+      session_idle();
+#endif
     if (timeout > 0 && elapsed > (uint16_t)timeout)
     {
        if (attract)
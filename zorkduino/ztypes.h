@@ -45,17 +45,129 @@
 //================================================================================
 //================================================================================
 
+// Parts with 8k of RAM or more (1284P, 2560) get a bigger block and line
+// cache, pinned globals, write tracking, the journal and background reads.
+// 2k and 2.5k parts (328, 32U4) get the small versions. Define it to force.
+#ifndef BIG_RAM
+#if defined(RAMEND) && (RAMEND >= 0x20FF)
+#define BIG_RAM 1
+#else
+#define BIG_RAM 0
+#endif
+#endif
+
 #define SAVE_SIZE           ((64+2)*1024L)
 #define SAVE_SLOTS          10
 #define STACK_REGION_OFFSET 0
 #define GAME_REGION_OFFSET  (STACK_REGION_OFFSET + 2048L)
 #define SAVE_REGION_OFFSET  (GAME_REGION_OFFSET + 256*1024L)
 #define MEMORY_FILE_SIZE    (SAVE_REGION_OFFSET + SAVE_SLOTS*SAVE_SIZE)
+#define STACK_SECTOR        (STACK_REGION_OFFSET >> 9)
+#define GAME_SECTOR         (GAME_REGION_OFFSET >> 9)
+
+// Only dynamic memory (at most 64k) lives in the game region, static memory
+// is read from the story file. The rest of the region holds zd.mem's own data
+#define DYNAMIC_MAX         (64*1024L)
+#define META_REGION_OFFSET  (GAME_REGION_OFFSET + DYNAMIC_MAX)
+#define META_SECTORS        24
+
+// Several stories stay resident, each with its own stack and dynamic memory.
+// Slot 0 is the stack and game regions above, the others follow the meta
+// sectors. The catalog has a sector per slot.
+#define GAME_SLOTS          3
+#define GAME_SLOT_SECTORS   (SAVE_SIZE >> 9)
+#define CATALOG_SECTOR      (META_REGION_OFFSET >> 9)
+#define GAME_SLOT_SECTOR(_n) ((_n) ? CATALOG_SECTOR + META_SECTORS + ((_n)-1)*GAME_SLOT_SECTORS : 0)
+
+// Extent maps of zd.mem (0) and the story in each game slot (1+slot). Without
+// FILE_MAPS there is no flash for them and both files must be contiguous
+#ifndef FILE_MAPS
+#define FILE_MAPS           BIG_RAM
+#endif
+#define MAP_SECTORS         4
+#define MAP_SECTOR(_f)      (CATALOG_SECTOR + GAME_SLOTS + (_f)*MAP_SECTORS)
+
+// Dynamic memory sectors written since each game slot was loaded
+#define WRITTEN_SECTOR(_n)  (MAP_SECTOR(GAME_SLOTS+1) + (_n))
+
+// What each save slot holds, for listing them in a single read
+#define SLOT_DIR_SECTOR     WRITTEN_SECTOR(GAME_SLOTS)
+
+// The rest of the game region is the journal: stack and dynamic memory
+// sectors written since the last checkpoint, each line read committing them
+#define JOURNAL_SECTOR      GAME_SLOT_SECTOR(GAME_SLOTS)
+#define JOURNAL_SECTORS     96
+
+// 2k parts have no RAM for its map, they write in place and checkpoint
+// zd.mem itself once the player pauses at a line read
+#if BIG_RAM
+#define JOURNAL 1
+#else
+#define JOURNAL 0
+#endif
+
+// 2k parts have no RAM to note which of those, or which stack and dynamic
+// memory sectors since a save, were written: they look at them all
+#if BIG_RAM
+#define WRITE_TRACKING 1
+#else
+#define WRITE_TRACKING 0
+#endif
+
+#if JOURNAL_SECTOR + JOURNAL_SECTORS > (SAVE_REGION_OFFSET >> 9) || SLOT_DIR_SECTOR >= CATALOG_SECTOR + META_SECTORS
+#error "Game slots don't fit in the game region"
+#endif
+
+// 2k parts have no flash to spare for the pool, each save slot there is a
+// plain copy of the stack and dynamic memory filling the save region.
+#ifndef SAVE_POOL
+#define SAVE_POOL           BIG_RAM
+#endif
+#define SAVE_SLOT_SECTOR(_s) ((SAVE_REGION_OFFSET >> 9) + (_s)*GAME_SLOT_SECTORS)
+
+// With SAVE_POOL each save slot is a manifest of sectors in a pool shared
+// by all slots. The pool's live bitmap and a manifest each take a spare
+// block while saving.
+// Undo levels are a ring of further manifests after the save slots'.
+// Save slots have a second manifest each, so a save replaces the last one
+// only when its header lands.
+#define UNDO_SLOTS          8
+#define MANIFEST_SECTORS    5
+#define MANIFEST_SECTOR(_s) ((SAVE_REGION_OFFSET >> 9) + (_s)*MANIFEST_SECTORS)
+#define POOL_SECTOR         MANIFEST_SECTOR(SAVE_SLOTS + UNDO_SLOTS)
+#define POOL_SECTORS        1024
+
+// One Quetzal (IFZS) file at a time, for moving saves to and from the host.
+// 2k parts have no flash for it, and no room past their fixed slots.
+#ifndef QUETZAL
+#define QUETZAL             SAVE_POOL
+#endif
+#define EXPORT_SECTOR       (POOL_SECTOR + POOL_SECTORS)
+#define EXPORT_SECTORS      144
+
+// The pool's live bitmap as of the last save, so saves needn't read every manifest
+#define POOL_LIVE_SECTOR    (EXPORT_SECTOR + EXPORT_SECTORS)
+#define SHADOW_SECTOR(_s)   (POOL_LIVE_SECTOR + 1 + (_s)*MANIFEST_SECTORS)
+#define SPARE_SECTOR        SHADOW_SECTOR(SAVE_SLOTS)
+
+#if SPARE_SECTOR > (MEMORY_FILE_SIZE >> 9)
+#error "Save pool doesn't fit in the save region"
+#endif
+
+#if QUETZAL && !SAVE_POOL
+#error "The export area is laid out after the save pool"
+#endif
 
 #define TEXT_COLS 38
 #define TEXT_ROWS 24
 extern uint8_t _fdata[TEXT_ROWS*TEXT_COLS];
 
+// Audio feedback for keyboard and io
+#define HSYNC_FREQ (1000000/63.555)
+#define KEYBEEP_FREQ (HSYNC_FREQ/1000)
+#define DISKBEEP_FREQ (HSYNC_FREQ/3600)
+extern void audio_beep(uint8_t freq, uint8_t cycles);
+
 extern void zdInit();
 extern void zdLoop();
 
@@ -180,6 +292,26 @@ typedef struct zheader {
     zword_t filler3[4];
 } zheader_t;
 
+// Catalog entry, says which story a game slot holds and if it can be resumed
+
+#define PAGEFILE_MAGIC      0x445A  /* "ZD" */
+#define SESSION_NONE        0
+#define SESSION_DIRTY       1       /* being written, not consistent */
+#define SESSION_CLEAN       2       /* consistent, resume at pc unless 0 */
+
+typedef struct pageheader {
+    zword_t magic;
+    char name[14];
+    zword_t release;
+    zword_t checksum;
+    zbyte_t state;
+    zbyte_t journal;                /* checkpoints since picked, see journal_replay */
+    unsigned long pc;
+    zword_t sp;
+    zword_t fp;
+    zword_t used;                   /* last picked, for replacement */
+} pageheader_t;
+
 #define H_TYPE 0
 #define H_CONFIG 1
 
@@ -322,7 +454,9 @@ typedef struct zobjectv4 {
 #define ASYNC 0x0200
 
 #define ARGS_MASK 0x00ff
-#define TYPE_MASK 0xff00
+#define TYPE_MASK 0x0f00
+#define VARS_MASK 0xf000     /* local count, for Quetzal exports */
+#define VARS_SHIFT 12
 
 /* Local defines */
 
@@ -404,6 +538,8 @@ extern void STACK(zword_t i,zword_t v);
 extern zword_t sp;
 extern zword_t fp;
 extern unsigned long pc;
+extern zword_t op_sp;
+extern unsigned long op_pc;
 extern uint8_t interpreter_state;
 extern int interpreter_status;
 
@@ -592,6 +728,55 @@ zbyte_t read_code_byte (void);
 zbyte_t read_data_byte (unsigned long *);
 zword_t read_code_word (void);
 zword_t read_data_word (unsigned long *);
+zbyte_t *read_data_span (unsigned long, zbyte_t *); /* valid until the next memory access */
+zword_t load_global (zbyte_t);
+void store_global (zbyte_t, zword_t);
+void pin_load (void);
+#if BIG_RAM
+void prefetch_code (unsigned long);
+#else
+#define prefetch_code(a)    /* 2k parts have no spare block to read into */
+#endif
+void session_checkpoint (void);
+void session_idle (void);
+void restart_reload (void);
+
+/* zdSave.cpp */
+uint8_t save_store (uint8_t, uint16_t);
+uint8_t save_load (uint8_t, uint16_t);
+uint16_t save_sector (uint8_t, uint16_t);
+#if WRITE_TRACKING
+void page_mark (uint16_t);
+void page_track (uint8_t);
+#else
+#define page_mark(s)        /* every sector is looked at */
+#define page_track(s)
+#endif
+#if JOURNAL
+uint16_t journal_sector (uint16_t);
+uint8_t journal_put (uint16_t, uint8_t *);
+uint8_t journal_commit (unsigned long, uint16_t, uint16_t);
+uint8_t journal_apply (bool);
+uint8_t journal_replay (pageheader_t *);
+extern uint16_t journal_used;
+extern uint8_t journal_epoch;
+#else
+#define journal_put(s,d)    1       /* written in place */
+#define journal_replay(h)   0
+#endif
+#if QUETZAL
+uint8_t quetzal_export (void);
+uint8_t quetzal_import (void);
+#endif
+
+/* zorkduino.ino */
+uint32_t sector_mem (uint16_t);
+void session_dirty (uint16_t);
+#if WRITE_TRACKING
+void written_mark (uint16_t);
+#else
+#define written_mark(s)
+#endif
 
 /* object.c */
 